@@ -17,12 +17,42 @@
 */
 
 #include <iostream>
+#include <cstddef>
 #include <cmath>
 #include <ctime>
-#include <arpa/inet.h> // for ntohl, etc
+#include <chrono>
+#include <cstdlib>
+#include <climits>
+#include <cerrno>
+#include <cctype>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Lengths of strings are 64 bits, as q's are (RapidJSON defaults to unsigned)
+#define RAPIDJSON_NO_SIZETYPEDEFINE
+namespace rapidjson { typedef ::std::size_t SizeType; }
 
 #include "rapidjson/stringbuffer.h"
 #include "rapidjson/writer.h"
+#include "rapidjson/reader.h"
+#include "rapidjson/memorystream.h"
+#include "rapidjson/error/en.h"
 
 #define KXVER 3
 #include "k.h"
@@ -30,40 +60,195 @@
 using namespace rapidjson;
 
 
-template<typename Writer> void serialise_atom(Writer& w, K x, int i = -1);
+// Options of a call, see read_options
+struct Options
+{
+    Options() : compact(false), deflate(false), frame(0), level(Z_DEFAULT_COMPRESSION),
+                maxbytes(0), maxdepth(0), maxtime(0), truncate(false), bytes(bytes_array), canonical(false),
+                scale(0), trim(false) {}
+
+    enum Bytes { bytes_array, bytes_hex, bytes_base64 };
+
+    bool compact;   // columnar encoding of tables
+    bool deflate;   // permessage-deflate websocket frames
+    J frame;        // largest websocket frame payload, 0 for one frame
+    int level;      // zlib compression level
+
+    // Budgets, 0 for none
+    J maxbytes;     // bytes of output
+    J maxdepth;     // nesting of arrays and objects
+    J maxtime;      // nanoseconds of wall time
+    bool truncate;  // return what fits rather than an error
+
+    Bytes bytes;    // encoding of byte vectors
+    bool canonical; // members of objects in order of name
+
+    K scale;        // dictionary of long column names to decimal places, or 0
+    bool trim;      // scaled columns without trailing zeros
+};
+
+static const Options default_options;
+
+// Vector elements between checks of the budgets, a power of 2
+static const J budget_stride = 4096;
+
+static inline J clock_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Writes n bytes straight to an output stream
+template<typename OutputStream>
+inline void put_raw(OutputStream& os, const char* s, size_t n)
+{
+    PutReserve(os, n);
+    for (size_t i = 0; i < n; i++) PutUnsafe(os, s[i]);
+}
+
+inline void put_raw(StringBuffer& os, const char* s, size_t n)
+{
+    memcpy(os.Push(n), s, n);
+}
+
+// RapidJSON's Writer, carrying the options of the call down to the serialisers
+// and keeping to their budgets
+template<typename OutputStream>
+class JsonWriter : public Writer<OutputStream>
+{
+    typedef Writer<OutputStream> Base;
+
+public:
+    JsonWriter(OutputStream& os, const Options& opts = default_options)
+        : Base(os), opts(opts), exceeded(0), syms(0), depth(0), start(opts.maxtime ? clock_ns() : 0), looked_up(0)
+    {
+    }
+
+    ~JsonWriter()
+    {
+        if (looked_up) r0(looked_up);
+    }
+
+    bool StartObject()              { enter(); return Base::StartObject(); }
+    bool EndObject(SizeType n = 0)  { depth--; return Base::EndObject(n); }
+    bool StartArray()               { enter(); return Base::StartArray(); }
+    bool EndArray(SizeType n = 0)   { depth--; return Base::EndArray(n); }
+
+    // Whether to go on to the next row or element. Once a budget runs out
+    // every loop stops, closing what is open, so the output stays valid.
+    bool Check()
+    {
+        if (exceeded) return false;
+        if (opts.maxbytes && (J)this->os_->GetSize() > opts.maxbytes) exceeded = "maxbytes exceeded";
+        else if (opts.maxtime && clock_ns() - start > opts.maxtime) exceeded = "maxtime exceeded";
+        return ! exceeded;
+    }
+
+    // As Check, for element i of a vector, looking at the budgets only so often
+    bool Continue(J i)
+    {
+        return i & (budget_stride - 1) ? ! exceeded : Check();
+    }
+
+    // Writes JSON text straight to the output, within a value or array
+    // already started (eg: the elements of an array, separators and all)
+    void PutRaw(const char* s, size_t n)
+    {
+        put_raw(*this->os_, s, n);
+    }
+
+    // The list enumerations index into, `sym, looked up on first use.
+    // Writers away from the main thread cannot call into q, so are
+    // handed it instead.
+    K Syms()
+    {
+        if (! syms) syms = looked_up = k(0, (S)"sym", (K)0);
+        return syms;
+    }
+
+    const Options& opts;
+    const char* exceeded;   // the budget which ran out
+    K syms;
+
+private:
+    void enter()
+    {
+        if (++depth > opts.maxdepth && opts.maxdepth && ! exceeded) exceeded = "maxdepth exceeded";
+    }
+
+    J depth;
+    const J start;
+    K looked_up;
+};
+
+// The error of the budget which ran out, unless truncating
+template<typename Writer>
+static K budget_error(const Writer& w)
+{
+    return w.exceeded && ! w.opts.truncate ? krr((S)w.exceeded) : 0;
+}
+
+// The output r of a call, with truncate paired with whether it was cut short
+template<typename Writer>
+static K budget_result(const Writer& w, K r)
+{
+    return w.opts.truncate ? knk(2, r, kb(w.exceeded != 0)) : r;
+}
+
+template<typename Writer> void serialise_atom(Writer& w, K x, J i = -1);
 
-template<typename Writer> void serialise_list(Writer& w, K x, bool isvec, int i = -1);
+template<typename Writer> void serialise_list(Writer& w, K x, bool isvec, J i = -1);
 
-template<typename Writer> void serialise_sym(Writer& w, K x, bool isvec, int i = - 1);
-template<typename Writer> void serialise_enum_sym(Writer& w, K x, bool isvec, int i = - 1);
-template<typename Writer> void serialise_char(Writer& w, K x, bool isvec, int i = -1);
-template<typename Writer> void serialise_bool(Writer& w, K x, bool isvec, int i = -1);
-template<typename Writer> void serialise_byte(Writer& w, K x, bool isvec, int i = -1);
-template<typename Writer> void serialise_short(Writer& w, K x, bool isvec, int i = -1);
-template<typename Writer> void serialise_int(Writer& w, K x, bool isvec, int i = -1);
-template<typename Writer> void serialise_long(Writer& w, K x, bool isvec, int i = -1);
-template<typename Writer> void serialise_float(Writer& w, K x, bool isvec, int i = -1);
-template<typename Writer> void serialise_double(Writer& w, K x, bool isvec, int i = -1);
+template<typename Writer> void serialise_sym(Writer& w, K x, bool isvec, J i = -1);
+template<typename Writer> void serialise_enum_sym(Writer& w, K x, bool isvec, J i = -1);
+template<typename Writer> void serialise_char(Writer& w, K x, bool isvec, J i = -1);
+template<typename Writer> void serialise_bool(Writer& w, K x, bool isvec, J i = -1);
+template<typename Writer> void serialise_byte(Writer& w, K x, bool isvec, J i = -1);
+template<typename Writer> void serialise_short(Writer& w, K x, bool isvec, J i = -1);
+template<typename Writer> void serialise_int(Writer& w, K x, bool isvec, J i = -1);
+template<typename Writer> void serialise_long(Writer& w, K x, bool isvec, J i = -1);
+template<typename Writer> void serialise_float(Writer& w, K x, bool isvec, J i = -1);
+template<typename Writer> void serialise_double(Writer& w, K x, bool isvec, J i = -1);
 
-template<typename Writer> void serialise_date(Writer& w, K x, bool isvec, int i = -1);
-template<typename Writer> void serialise_time(Writer& w, K x, bool isvec, int i = -1);
-template<typename Writer> void serialise_timestamp(Writer& w, K x, bool isvec, int i = -1);
-template<typename Writer> void serialise_timespan(Writer& w, K x, bool isvec, int i = -1);
-template<typename Writer> void serialise_datetime(Writer& w, K x, bool isvec, int i = -1);
-template<typename Writer> void serialise_month(Writer& w, K x, bool isvec, int i = -1);
-template<typename Writer> void serialise_minute(Writer& w, K x, bool isvec, int i = -1);
-template<typename Writer> void serialise_second(Writer& w, K x, bool isvec, int i = -1);
+template<typename Writer> void serialise_date(Writer& w, K x, bool isvec, J i = -1);
+template<typename Writer> void serialise_time(Writer& w, K x, bool isvec, J i = -1);
+template<typename Writer> void serialise_timestamp(Writer& w, K x, bool isvec, J i = -1);
+template<typename Writer> void serialise_timespan(Writer& w, K x, bool isvec, J i = -1);
+template<typename Writer> void serialise_datetime(Writer& w, K x, bool isvec, J i = -1);
+template<typename Writer> void serialise_month(Writer& w, K x, bool isvec, J i = -1);
+template<typename Writer> void serialise_minute(Writer& w, K x, bool isvec, J i = -1);
+template<typename Writer> void serialise_second(Writer& w, K x, bool isvec, J i = -1);
 
-template<typename Writer> void serialise_guid(Writer& w, K x, bool isvec, int i = -1);
+template<typename Writer> void serialise_guid(Writer& w, K x, bool isvec, J i = -1);
 
-template<typename Writer> void serialise_dict(Writer& w, K x, bool isvec, int i = -1);
-template<typename Writer> void serialise_table(Writer& w, K x, bool isvec, int i = -1);
+template<typename Writer> void serialise_dict(Writer& w, K x, bool isvec, J i = -1);
+template<typename Writer> void serialise_table(Writer& w, K x, bool isvec, J i = -1);
 
 template<typename Writer> void serialise_keyed_table(Writer& w, K keys, K values);
+template<typename Writer> void serialise_row(Writer& w, K kkeys, K kvalues, K vkeys, K vvalues, J i);
+template<typename Writer> void serialise_compact_table(Writer& w, K kkeys, K kvalues, K vkeys, K vvalues);
+template<typename Writer> void serialise_unhandled(Writer& w, K x, bool isvec, J i = -1);
+
+// The serialiser of lists or atoms of a type
+template<typename Writer> using Serialiser = void (*)(Writer& w, K x, bool isvec, J i);
+template<typename Writer> Serialiser<Writer> serialiser_of(int t);
+
+// Orders object members by name, for canonical output
+static bool member_less(const std::pair<S, K>& a, const std::pair<S, K>& b)
+{
+    return strcmp(a.first, b.first) < 0;
+}
+
+// Orders indices into a symbol list by the symbols, for canonical output
+struct SymbolLess
+{
+    SymbolLess(K syms) : syms(syms) {}
+    bool operator()(J a, J b) const { return strcmp(kS(syms)[a], kS(syms)[b]) < 0; }
+    K syms;
+};
 
 
 template<typename Writer>
-void serialise_list(Writer& w, K x, bool isvec, int i)
+void serialise_list(Writer& w, K x, bool isvec, J i)
 {
     if (isvec)
     {
@@ -75,7 +260,7 @@ void serialise_list(Writer& w, K x, bool isvec, int i)
         else
         {
             w.StartArray();
-            for (int i = 0; i < x->n; i++)
+            for (J i = 0; i < x->n && w.Check(); i++)
             {
                 K v = kK(x)[i];
                 serialise_atom(w, v);
@@ -91,7 +276,7 @@ void serialise_list(Writer& w, K x, bool isvec, int i)
 }
 
 template<typename Writer>
-void serialise_sym(Writer& w, K x, bool isvec, int i)
+void serialise_sym(Writer& w, K x, bool isvec, J i)
 {
     if (isvec)
     {
@@ -102,7 +287,7 @@ void serialise_sym(Writer& w, K x, bool isvec, int i)
         else
         {
             w.StartArray();
-            for (int i = 0; i < x->n; i++)
+            for (J i = 0; i < x->n && w.Continue(i); i++)
             {
                 w.String((char*)kS(x)[i]);
             }
@@ -127,9 +312,9 @@ void emit_enum_sym(Writer& w, K sym, int sym_idx)
 }
 
 template<typename Writer>
-void serialise_enum_sym(Writer& w, K x, bool isvec, int i)
+void serialise_enum_sym(Writer& w, K x, bool isvec, J i)
 {
-    K sym = k(0, (S)"sym", (K)0);
+    const K sym = w.Syms();
     if (! sym || sym->t != 11) {
         w.Null();
         return;
@@ -144,7 +329,7 @@ void serialise_enum_sym(Writer& w, K x, bool isvec, int i)
         else
         {
             w.StartArray();
-            for (int i = 0; i < x->n; i++)
+            for (J i = 0; i < x->n && w.Continue(i); i++)
             {
                 emit_enum_sym(w, sym, kI(x)[i]);
             }
@@ -157,13 +342,46 @@ void serialise_enum_sym(Writer& w, K x, bool isvec, int i)
     }
 }
 
+// Whether a string has any character which JSON escapes (a quote, backslash or control)
+static inline bool needs_escape(const char* s, size_t n)
+{
+    size_t i = 0;
+
+    #ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1F);
+    for (; i + 16 <= n; i += 16)
+    {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        const __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+                                       _mm_cmpeq_epi8(_mm_min_epu8(v, control), v));
+        if (_mm_movemask_epi8(m)) return true;
+    }
+    #endif
+
+    for (; i < n; i++)
+    {
+        const unsigned char c = s[i];
+        if (c == '"' || c == '\\' || c < 0x20) return true;
+    }
+    return false;
+}
+
 template<typename Writer>
-void serialise_char(Writer& w, K x, bool isvec, int i)
+void serialise_char(Writer& w, K x, bool isvec, J i)
 {
     if (isvec)
     {
 	if(i == -1) {
-	    w.String((char*)&kC(x), x->n);
+	    if (needs_escape((const char*)kC(x), x->n)) {
+		w.String((char*)&kC(x), x->n);
+	    } else {
+		// Nothing to escape, so copied straight to the output
+		w.RawValue("\"", 1, kStringType);
+		w.PutRaw((const char*)kC(x), x->n);
+		w.PutRaw("\"", 1);
+	    }
 	} else {
 	    w.String((char*)&kC(x)[i], 1);
 	}
@@ -176,7 +394,7 @@ void serialise_char(Writer& w, K x, bool isvec, int i)
 }
 
 template<typename Writer>
-void serialise_bool(Writer& w, K x, bool isvec, int i)
+void serialise_bool(Writer& w, K x, bool isvec, J i)
 {
     if (isvec)
     {
@@ -187,7 +405,7 @@ void serialise_bool(Writer& w, K x, bool isvec, int i)
         else
         {
             w.StartArray();
-            for (int i = 0; i < x->n; i++)
+            for (J i = 0; i < x->n && w.Continue(i); i++)
             {
                 w.Bool((int)kG(x)[i] != 0);
             }
@@ -200,20 +418,104 @@ void serialise_bool(Writer& w, K x, bool isvec, int i)
     }
 }
 
+// The hex digits of every byte, two to a byte
+struct HexPairs
+{
+    HexPairs()
+    {
+        static const char* digits = "0123456789abcdef";
+        for (int i = 0; i < 256; i++)
+        {
+            pairs[2 * i] = digits[i >> 4];
+            pairs[2 * i + 1] = digits[i & 0xF];
+        }
+    }
+
+    char pairs[512];
+};
+
+static const HexPairs hex_pairs;
+
+// Writes the 2n hex digits of n bytes to out
+static inline void hex_encode(const unsigned char* in, size_t n, char* out)
+{
+    #ifdef __SSSE3__
+    // Each nibble looks up its digit with a shuffle, 16 bytes at a time
+    const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+    const __m128i nibble = _mm_set1_epi8(0xF);
+    for (; n >= 16; n -= 16, in += 16, out += 32)
+    {
+        const __m128i v = _mm_loadu_si128((const __m128i*)in);
+        const __m128i hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+        const __m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(v, nibble));
+        _mm_storeu_si128((__m128i*)out, _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i*)(out + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+    #endif
+    for (; n > 0; n--, in++, out += 2)
+    {
+        memcpy(out, &hex_pairs.pairs[2 * *in], 2);
+    }
+}
+
+// Writes the base64 of n bytes to out, padded if n is not a multiple of 3
+static inline char* base64_encode(const unsigned char* in, size_t n, char* out)
+{
+    static const char* digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for (; n >= 3; n -= 3, in += 3)
+    {
+        const unsigned v = (in[0] << 16) | (in[1] << 8) | in[2];
+        *out++ = digits[v >> 18];
+        *out++ = digits[(v >> 12) & 0x3F];
+        *out++ = digits[(v >> 6) & 0x3F];
+        *out++ = digits[v & 0x3F];
+    }
+    if (n > 0)
+    {
+        const unsigned v = (in[0] << 16) | (n > 1 ? in[1] << 8 : 0);
+        *out++ = digits[v >> 18];
+        *out++ = digits[(v >> 12) & 0x3F];
+        *out++ = n > 1 ? digits[(v >> 6) & 0x3F] : '=';
+        *out++ = '=';
+    }
+    return out;
+}
+
+// Elements formatted at a time by the vector kernels, a divisor of budget_stride
+static const J raw_chunk = 256;
+
 template<typename Writer>
 inline void emit_byte(Writer& w, unsigned char n)
 {
-    const char * hex = "0123456789abcdef";
-    char buff[2];
+    w.String(&hex_pairs.pairs[2 * n], 2);
+}
 
-    buff[0] = hex[(n>>4) & 0xF];
-    buff[1] = hex[ n     & 0xF];
+// A byte vector as one hex or base64 string, encoded a chunk at a time
+template<typename Writer>
+void serialise_byte_string(Writer& w, K x)
+{
+    const bool hex = w.opts.bytes == Options::bytes_hex;
+    char buff[4 * 3 * raw_chunk];
 
-    w.String(buff, 2);
+    w.RawValue("\"", 1, kStringType);
+    for (J i = 0; i < x->n; i += 3 * raw_chunk)
+    {
+        const size_t n = std::min(x->n - i, 3 * raw_chunk);
+        if (hex)
+        {
+            hex_encode(kG(x) + i, n, buff);
+            w.PutRaw(buff, 2 * n);
+        }
+        else
+        {
+            w.PutRaw(buff, base64_encode(kG(x) + i, n, buff) - buff);
+        }
+    }
+    w.PutRaw("\"", 1);
 }
 
 template<typename Writer>
-void serialise_byte(Writer& w, K x, bool isvec, int i)
+void serialise_byte(Writer& w, K x, bool isvec, J i)
 {
     if (isvec)
     {
@@ -221,12 +523,29 @@ void serialise_byte(Writer& w, K x, bool isvec, int i)
         {
             emit_byte(w, kG(x)[i]);
         }
+        else if (w.opts.bytes != Options::bytes_array)
+        {
+            serialise_byte_string(w, x);
+        }
         else
         {
+            // "xx" per byte, a chunk at a time
+            char buff[5 * raw_chunk];
+
             w.StartArray();
-            for (int i = 0; i < x->n; i++)
+            for (J i = 0; i < x->n && w.Continue(i); i += raw_chunk)
             {
-                emit_byte(w, kG(x)[i]);
+                const J end = std::min(x->n, i + raw_chunk);
+                char* p = buff;
+                for (J j = i; j < end; j++)
+                {
+                    if (j) *p++ = ',';
+                    *p++ = '"';
+                    memcpy(p, &hex_pairs.pairs[2 * kG(x)[j]], 2);
+                    p += 2;
+                    *p++ = '"';
+                }
+                w.PutRaw(buff, p - buff);
             }
             w.EndArray();
         }
@@ -249,7 +568,7 @@ inline void emit_short(Writer& w, int n)
 }
 
 template<typename Writer>
-void serialise_short(Writer& w, K x, bool isvec, int i)
+void serialise_short(Writer& w, K x, bool isvec, J i)
 {
     if (isvec)
     {
@@ -260,7 +579,7 @@ void serialise_short(Writer& w, K x, bool isvec, int i)
         else
         {
             w.StartArray();
-            for (int i = 0; i < x->n; i++)
+            for (J i = 0; i < x->n && w.Continue(i); i++)
             {
                 emit_short(w, kH(x)[i]);
             }
@@ -285,7 +604,7 @@ inline void emit_int(Writer& w, int n)
 }
 
 template<typename Writer>
-void serialise_int(Writer& w, K x, bool isvec, int i)
+void serialise_int(Writer& w, K x, bool isvec, J i)
 {
     if (isvec)
     {
@@ -296,7 +615,7 @@ void serialise_int(Writer& w, K x, bool isvec, int i)
         else
         {
             w.StartArray();
-            for (int i = 0; i < x->n; i++)
+            for (J i = 0; i < x->n && w.Continue(i); i++)
             {
                 emit_int(w, kI(x)[i]);
             }
@@ -321,7 +640,7 @@ inline void emit_long(Writer& w, long long n)
 }
 
 template<typename Writer>
-void serialise_long(Writer& w, K x, bool isvec, int i)
+void serialise_long(Writer& w, K x, bool isvec, J i)
 {
     if (isvec)
     {
@@ -332,7 +651,7 @@ void serialise_long(Writer& w, K x, bool isvec, int i)
         else
         {
             w.StartArray();
-            for (int i = 0; i < x->n; i++)
+            for (J i = 0; i < x->n && w.Continue(i); i++)
             {
                 emit_long(w, kJ(x)[i]);
             }
@@ -345,715 +664,4876 @@ void serialise_long(Writer& w, K x, bool isvec, int i)
     }
 }
 
-template<typename Writer>
-inline void emit_double(Writer& w, double n)
+// Longs scaled by a power of 10 (eg: prices in units of 1e-8), written as
+// decimals using integers only: 12345600000 at scale 8 is 123.45600000, or
+// 123.456 trimmed
+
+// Longest output is 22 characters, -0.000000000000000001 or -9.223372036854775807
+static const int scaled_width = 22;
+
+// Decimal places a column can be given, up to the 18 digits a long always holds
+static const int max_scale = 18;
+
+// The decimal places of a column named name, or -1 when it is not scaled
+static int scale_of(const Options& opts, S name)
 {
-    if (std::isnan(n))
+    if (! opts.scale) return -1;
+
+    const K names = kK(opts.scale)[0];
+    const K places = kK(opts.scale)[1];
+    for (J i = 0; i < names->n; i++)
     {
-        w.Null();
+        if (kS(names)[i] != name) continue;
+        switch (places->t)
+        {
+            case (KH):  return kH(places)[i];
+            case (KI):  return kI(places)[i];
+            default:    return (int)kJ(places)[i];
+        }
     }
-    else if (std::isinf(n))
+    return -1;
+}
+
+// Writes n / 10^scale (not null), returning the end of the text
+static char* format_scaled(long long n, int scale, bool trim, char* p)
+{
+    static const unsigned long long powers[max_scale + 1] =
     {
-        w.String(n == INFINITY ? "Inf" : "-Inf");
+        1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL,
+        1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+        100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+        1000000000000000000ULL
+    };
+
+    const unsigned long long u = n < 0 ? 0ULL - n : n;
+    unsigned long long whole = u / powers[scale];
+    unsigned long long frac = u % powers[scale];
+
+    if (n < 0) *p++ = '-';
+
+    char digits[20];
+    char* q = digits + sizeof(digits);
+    do
+    {
+        *--q = (char)('0' + whole % 10);
+        whole /= 10;
     }
-    else
+    while (whole);
+    memcpy(p, q, digits + sizeof(digits) - q);
+    p += digits + sizeof(digits) - q;
+
+    if (scale == 0) return p;
+
+    // Trimmed, a whole number keeps one zero, as floats do (eg: 123.0)
+    int places = scale;
+    while (trim && places > 1 && frac % 10 == 0)
     {
-        w.Double(n);
+        frac /= 10;
+        places--;
     }
+
+    *p++ = '.';
+    for (int i = places - 1; i >= 0; i--, frac /= 10)
+    {
+        p[i] = (char)('0' + frac % 10);
+    }
+    return p + places;
 }
 
 template<typename Writer>
-void serialise_float(Writer& w, K x, bool isvec, int i)
+inline void emit_scaled(Writer& w, long long n, int scale, bool trim)
 {
-    if (isvec)
+    switch (n)
     {
-        if (i >= 0)
-        {
-            emit_double(w, kE(x)[i]);
-        }
-        else
+        case(wj):
+        case(nj):   w.Null(); break;
+        default:
         {
-            w.StartArray();
-            for (int i = 0; i < x->n; i++)
-            {
-                emit_double(w, kE(x)[i]);
-            }
-            w.EndArray();
+            char buff[scaled_width];
+            w.RawValue(buff, format_scaled(n, scale, trim, buff) - buff, kNumberType);
+            break;
         }
     }
-    else
-    {
-        emit_double(w, x->e);
-    }
 }
 
+// A whole scaled long vector, formatted a chunk at a time
 template<typename Writer>
-void serialise_double(Writer& w, K x, bool isvec, int i)
+void serialise_scaled(Writer& w, K x, int scale)
 {
-    if (isvec)
+    char buff[(scaled_width + 1) * raw_chunk];
+
+    w.StartArray();
+    for (J i = 0; i < x->n && w.Continue(i); i += raw_chunk)
     {
-        if (i >= 0)
+        const J end = std::min(x->n, i + raw_chunk);
+        char* p = buff;
+        for (J j = i; j < end; j++)
         {
-            emit_double(w, kF(x)[i]);
-        }
-        else
-        {
-            w.StartArray();
-            for (int i = 0; i < x->n; i++)
+            if (j) *p++ = ',';
+            const long long n = kJ(x)[j];
+            if (n == nj || n == wj)
             {
-                emit_double(w, kF(x)[i]);
+                memcpy(p, "null", 4);
+                p += 4;
+            }
+            else
+            {
+                p = format_scaled(n, scale, w.opts.trim, p);
             }
-            w.EndArray();
         }
+        w.PutRaw(buff, p - buff);
     }
-    else
-    {
-        emit_double(w, x->f);
-    }
+    w.EndArray();
 }
 
-template<typename Writer>
-inline void emit_date(Writer& w, int n)
+// Shortest round-trip doubles, after Ryu (Adams, PLDI 2018), laid out as
+// RapidJSON's Writer::Double lays them out: 1.0, 0.001, 1e30, 1.5e-7
+
+static const int pow5_bitcount = 125;
+static const int pow5_table_size = 326;
+static const int pow5_inv_table_size = 342;
+
+// Bits in 5^e, for 0 <= e <= 3528
+static inline int pow5_bits(int e)
 {
-    if (n == ni)
-    {
-        w.Null();
-    }
-    else
-    {
-        time_t tt = (n + 10957) * 8.64e4; // magic, see: https://github.com/kxcontrib/wiki/blob/master/csv.c
-        struct tm timinfo;
-        gmtime_r(&tt, &timinfo);
-        char buff[10+1];
-        snprintf(buff, sizeof(buff), "%04d-%02d-%02d", timinfo.tm_year+1900, timinfo.tm_mon+1, timinfo.tm_mday);
-        w.String(buff, 10);
-    }
+    return (int)(((uint32_t)e * 1217359) >> 19) + 1;
 }
 
-template<typename Writer>
-void serialise_date(Writer& w, K x, bool isvec, int i)
+// floor(log10(2^e)) and floor(log10(5^e)), for 0 <= e <= 1650 and 2620
+static inline uint32_t log10_pow2(int e)
 {
-    if (isvec)
+    return ((uint32_t)e * 78913) >> 18;
+}
+
+static inline uint32_t log10_pow5(int e)
+{
+    return ((uint32_t)e * 732923) >> 20;
+}
+
+// 5^i and 2^k / 5^i to 125 bits, computed with multi-word arithmetic on load
+struct Pow5Tables
+{
+    Pow5Tables()
     {
-        if (i >= 0)
+        std::vector<uint32_t> p(1, 1);
+        for (int i = 0; i < pow5_table_size; i++)
         {
-            emit_date(w, kI(x)[i]);
+            bits_from(p, pow5_bits(i) - pow5_bitcount, split[i]);
+            multiply(p, 5);
         }
-        else
+
+        for (int i = 0; i < pow5_inv_table_size; i++)
         {
-            w.StartArray();
-            for (int i = 0; i < x->n; i++)
+            const int k = pow5_bits(i) - 1 + pow5_bitcount;
+            std::vector<uint32_t> q(k / 32 + 1, 0);
+            q[k / 32] = 1u << (k % 32);
+            for (int j = i; j > 0; j -= 13)
             {
-                emit_date(w, kI(x)[i]);
+                uint32_t d = 1;
+                for (int n = std::min(j, 13); n > 0; n--) d *= 5;
+                divide(q, d);
             }
-            w.EndArray();
+            bits_from(q, 0, inv_split[i]);
+            if (++inv_split[i][0] == 0) inv_split[i][1]++;
         }
     }
-    else
-    {
-        emit_date(w, x->i);
-    }
-}
 
-template<typename Writer>
-inline void emit_time(Writer& w, int n)
-{
-    if (n == ni)
-    {
-        w.Null();
-    }
-    else
+    uint64_t split[pow5_table_size][2];
+    uint64_t inv_split[pow5_inv_table_size][2];
+
+private:
+    static void multiply(std::vector<uint32_t>& v, uint32_t m)
     {
-        time_t tt = n / 1000;
-        struct tm timinfo;
-        gmtime_r(&tt, &timinfo);
-        char buff[12+1];
-        snprintf(buff, sizeof(buff), "%02d:%02d:%02d.%03d", timinfo.tm_hour, timinfo.tm_min, timinfo.tm_sec, n % 1000);
-        w.String(buff, 12);
+        uint64_t carry = 0;
+        for (size_t i = 0; i < v.size(); i++)
+        {
+            carry += (uint64_t)v[i] * m;
+            v[i] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        if (carry) v.push_back((uint32_t)carry);
     }
-}
 
-template<typename Writer>
-void serialise_time(Writer& w, K x, bool isvec, int i)
-{
-    if (isvec)
+    static void divide(std::vector<uint32_t>& v, uint32_t d)
     {
-        if (i >= 0)
+        uint64_t rem = 0;
+        for (size_t i = v.size(); i-- > 0;)
         {
-            emit_time(w, kI(x)[i]);
+            rem = (rem << 32) | v[i];
+            v[i] = (uint32_t)(rem / d);
+            rem %= d;
         }
-        else
+    }
+
+    // The 128 bits of v from bit from upwards, from may be negative
+    static void bits_from(const std::vector<uint32_t>& v, int from, uint64_t* out)
+    {
+        out[0] = out[1] = 0;
+        for (int b = 0; b < 128; b++)
         {
-            w.StartArray();
-            for (int i = 0; i < x->n; i++)
+            const int at = from + b;
+            if (at >= 0 && at / 32 < (int)v.size() && (v[at / 32] >> (at % 32) & 1))
             {
-                emit_time(w, kI(x)[i]);
+                out[b / 64] |= 1ULL << (b % 64);
             }
-            w.EndArray();
         }
     }
-    else
+};
+
+static const Pow5Tables pow5_tables;
+
+// (m * mul) >> j, for a 128 bit mul and 64 < j < 128
+static inline uint64_t mul_shift(uint64_t m, const uint64_t* mul, int j)
+{
+    #ifdef __SIZEOF_INT128__
+    const unsigned __int128 b0 = (unsigned __int128)m * mul[0];
+    const unsigned __int128 b2 = (unsigned __int128)m * mul[1];
+    return (uint64_t)(((b0 >> 64) + b2) >> (j - 64));
+    #else
+    // Four 32 bit products each, for targets without 128 bit integers
+    struct Wide
     {
-        emit_time(w, x->i);
-    }
+        static uint64_t mul(uint64_t a, uint64_t b, uint64_t& hi)
+        {
+            const uint64_t a0 = (uint32_t)a, a1 = a >> 32, b0 = (uint32_t)b, b1 = b >> 32;
+            const uint64_t p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+            const uint64_t mid = (p00 >> 32) + (uint32_t)p10 + (uint32_t)p01;
+            hi = p11 + (p10 >> 32) + (p01 >> 32) + (mid >> 32);
+            return (mid << 32) | (uint32_t)p00;
+        }
+    };
+    uint64_t hi0, hi2;
+    Wide::mul(m, mul[0], hi0);
+    const uint64_t lo2 = Wide::mul(m, mul[1], hi2);
+    const uint64_t lo = hi0 + lo2;
+    const uint64_t hi = hi2 + (lo < hi0);
+    const int s = j - 64;
+    return (hi << (64 - s)) | (lo >> s);
+    #endif
 }
 
-template<typename Writer>
-inline void emit_timestamp(Writer& w, long long n)
+static inline uint32_t pow5_factor(uint64_t v)
 {
-    if (n == nj)
-    {
-        w.Null();
-    }
-    else
-    {
-        time_t tt = n * 1e-9 + 10957 * 8.64e4; // magic, see: https://github.com/kxcontrib/wiki/blob/master/csv.c
-        struct tm timinfo;
-        gmtime_r(&tt, &timinfo);
-        char buff[29+1];
-        snprintf(buff, sizeof(buff),
-            "%04d-%02d-%02dD%02d:%02d:%02d.%09lld",
-            timinfo.tm_year+1900, timinfo.tm_mon+1, timinfo.tm_mday,
-            timinfo.tm_hour, timinfo.tm_min, timinfo.tm_sec, n%1000000000);
-        w.String(buff, 29);
-    }
+    uint32_t n = 0;
+    for (; v % 5 == 0; v /= 5) n++;
+    return n;
 }
 
-template<typename Writer>
-void serialise_timestamp(Writer& w, K x, bool isvec, int i)
+// The shortest digits which read back as v, a finite double > 0, and their power of ten
+static uint64_t shortest_digits(double v, int& e10)
 {
-    if (isvec)
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    const uint64_t ieee_mantissa = bits & ((1ULL << 52) - 1);
+    const int ieee_exponent = (int)(bits >> 52) & 0x7FF;
+
+    // Integers below 2^53 are their own digits, less any trailing zeros
+    if (ieee_exponent >= 1023 && ieee_exponent <= 1023 + 52)
     {
-        if (i >= 0)
+        const int shift = 1023 + 52 - ieee_exponent;
+        const uint64_t m = (1ULL << 52) | ieee_mantissa;
+        if ((m & ((1ULL << shift) - 1)) == 0)
         {
-            emit_timestamp(w, kJ(x)[i]);
-        }
-        else
-        {
-            w.StartArray();
-            for (int i = 0; i < x->n; i++)
-            {
-                emit_timestamp(w, kJ(x)[i]);
-            }
-            w.EndArray();
+            uint64_t digits = m >> shift;
+            for (e10 = 0; digits % 10 == 0; e10++) digits /= 10;
+            return digits;
         }
     }
+
+    // v = m2 * 2^e2, with two bits spare to hold the halfway points either side
+    int e2;
+    uint64_t m2;
+    if (ieee_exponent == 0)
+    {
+        e2 = 1 - 1023 - 52 - 2;
+        m2 = ieee_mantissa;
+    }
     else
     {
-        emit_timestamp(w, x->j);
+        e2 = ieee_exponent - 1023 - 52 - 2;
+        m2 = (1ULL << 52) | ieee_mantissa;
     }
-}
+    const bool accept_bounds = (m2 & 1) == 0;
+    const uint64_t mv = 4 * m2;
+    const uint32_t mm_shift = ieee_mantissa != 0 || ieee_exponent <= 1;
 
-
-template<typename Writer>
-inline void emit_timespan(Writer& w, long long n)
-{
-    if (n == nj)
+    // The interval of values reading back as v, scaled to a power of ten
+    uint64_t vr, vp, vm;
+    bool vm_zeros = false;
+    bool vr_zeros = false;
+    if (e2 >= 0)
     {
-        w.Null();
+        const uint32_t q = log10_pow2(e2) - (e2 > 3);
+        const int k = pow5_bitcount + pow5_bits(q) - 1;
+        const int j = -e2 + (int)q + k;
+        const uint64_t* mul = pow5_tables.inv_split[q];
+        e10 = (int)q;
+        vr = mul_shift(mv, mul, j);
+        vp = mul_shift(mv + 2, mul, j);
+        vm = mul_shift(mv - 1 - mm_shift, mul, j);
+        if (q <= 21)
+        {
+            if (mv % 5 == 0)
+            {
+                vr_zeros = pow5_factor(mv) >= q;
+            }
+            else if (accept_bounds)
+            {
+                vm_zeros = pow5_factor(mv - 1 - mm_shift) >= q;
+            }
+            else
+            {
+                vp -= pow5_factor(mv + 2) >= q;
+            }
+        }
     }
     else
     {
-        // FUDGE: tm_yday gets truncated to within (0, 365) so large timespans
-        // do not convert correctly. Deletgate to kdb internal conversion instead.
-        K x = kj(n);
-        K sp = k(0, (S)"string `timespan$ ", x, (K)0);
-        if (sp->t == KC)
+        const uint32_t q = log10_pow5(-e2) - (-e2 > 1);
+        const int i = -e2 - (int)q;
+        const int k = pow5_bits(i) - pow5_bitcount;
+        const int j = (int)q - k;
+        const uint64_t* mul = pow5_tables.split[i];
+        e10 = (int)q + e2;
+        vr = mul_shift(mv, mul, j);
+        vp = mul_shift(mv + 2, mul, j);
+        vm = mul_shift(mv - 1 - mm_shift, mul, j);
+        if (q <= 1)
         {
-            w.String((char*)&kC(sp)[0], sp->n);
+            vr_zeros = true;
+            if (accept_bounds)
+            {
+                vm_zeros = mm_shift == 1;
+            }
+            else
+            {
+                --vp;
+            }
         }
-        else
+        else if (q < 63)
         {
-            w.Null();
+            vr_zeros = (mv & ((1ULL << q) - 1)) == 0;
         }
-        r0(sp);
     }
-}
 
-template<typename Writer>
-void serialise_timespan(Writer& w, K x, bool isvec, int i)
-{
-    if (isvec)
+    // Drop digits while the interval still holds a shorter number, rounding vr to nearest
+    int removed = 0;
+    uint64_t digits;
+    if (vm_zeros || vr_zeros)
     {
-        if (i >= 0)
+        int last = 0;
+        for (; vp / 10 > vm / 10; removed++)
         {
-            emit_timespan(w, kJ(x)[i]);
+            vm_zeros &= vm % 10 == 0;
+            vr_zeros &= last == 0;
+            last = (int)(vr % 10);
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
         }
-        else
+        if (vm_zeros)
         {
-            w.StartArray();
-            for (int i = 0; i < x->n; i++)
+            for (; vm % 10 == 0; removed++)
             {
-                emit_timespan(w, kJ(x)[i]);
+                vr_zeros &= last == 0;
+                last = (int)(vr % 10);
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
             }
-            w.EndArray();
         }
+        if (vr_zeros && last == 5 && vr % 2 == 0)
+        {
+            last = 4;    // exactly halfway, round to even
+        }
+        digits = vr + ((vr == vm && (!accept_bounds || !vm_zeros)) || last >= 5);
     }
     else
     {
-        emit_timespan(w, x->j);
+        bool round_up = false;
+        if (vp / 100 > vm / 100)
+        {
+            round_up = vr % 100 >= 50;
+            vr /= 100;
+            vp /= 100;
+            vm /= 100;
+            removed += 2;
+        }
+        for (; vp / 10 > vm / 10; removed++)
+        {
+            round_up = vr % 10 >= 5;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+        }
+        digits = vr + (vr == vm || round_up);
     }
+    e10 += removed;
+    return digits;
 }
 
-template<typename Writer>
-inline void emit_datetime(Writer& w, double n)
+static inline char* write_exponent(int k, char* p)
 {
-    if (std::isnan(n))
+    if (k < 0)
     {
-        w.Null();
+        *p++ = '-';
+        k = -k;
+    }
+    if (k >= 100)
+    {
+        *p++ = (char)('0' + k / 100);
+        k %= 100;
+        *p++ = (char)('0' + k / 10);
+    }
+    else if (k >= 10)
+    {
+        *p++ = (char)('0' + k / 10);
+    }
+    *p++ = (char)('0' + k % 10);
+    return p;
+}
+
+// Longest output is 25 characters, -0.0000012345678901234567 or -1.2345678901234567e-308
+static const int double_width = 25;
+
+// Writes digits * 10^k as RapidJSON's Prettify would, returning the end of the text
+static char* layout_digits(uint64_t digits, int k, char* p)
+{
+    int length = 1;
+    for (uint64_t d = digits; d >= 10; d /= 10) length++;
+    for (int i = length - 1; i >= 0; i--, digits /= 10)
+    {
+        p[i] = (char)('0' + digits % 10);
+    }
+
+    // 10^(kk-1) <= v < 10^kk
+    const int kk = length + k;
+    if (k >= 0 && kk <= 21)
+    {
+        memset(p + length, '0', kk - length);
+        memcpy(p + kk, ".0", 2);
+        return p + kk + 2;
+    }
+    else if (kk > 0 && kk <= 21)
+    {
+        memmove(p + kk + 1, p + kk, length - kk);
+        p[kk] = '.';
+        return p + length + 1;
+    }
+    else if (kk > -6 && kk <= 0)
+    {
+        const int offset = 2 - kk;
+        memmove(p + offset, p, length);
+        p[0] = '0';
+        p[1] = '.';
+        memset(p + 2, '0', offset - 2);
+        return p + length + offset;
+    }
+    else if (length == 1)
+    {
+        p[1] = 'e';
+        return write_exponent(kk - 1, p + 2);
     }
     else
     {
-        time_t tt = (n + 10957) * 8.64e4;
-        struct tm timinfo;
-        gmtime_r(&tt, &timinfo);
-        char buff[23+1];
-        snprintf(buff, sizeof(buff),
-            "%04d-%02d-%02dT%02d:%02d:%02d.%03lld",
-            timinfo.tm_year+1900, timinfo.tm_mon+1, timinfo.tm_mday,
-            timinfo.tm_hour, timinfo.tm_min, timinfo.tm_sec, (long long)(round(n*8.64e7))%1000);
-        w.String(buff, 23);
+        memmove(p + 2, p + 1, length - 1);
+        p[1] = '.';
+        p[length + 1] = 'e';
+        return write_exponent(kk - 1, p + length + 2);
     }
 }
 
-template<typename Writer>
-void serialise_datetime(Writer& w, K x, bool isvec, int i)
+// Writes finite v as RapidJSON would, returning the end of the text
+static char* format_double(double v, char* p)
 {
-    if (isvec)
+    if (std::signbit(v))
     {
-        if (i >= 0)
+        *p++ = '-';
+        v = -v;
+    }
+    if (v == 0)
+    {
+        memcpy(p, "0.0", 3);
+        return p + 3;
+    }
+
+    int k;
+    const uint64_t digits = shortest_digits(v, k);
+    return layout_digits(digits, k, p);
+}
+
+// The shortest digits which read back as v, a finite float > 0, and their power of ten.
+// The float kernel of Ryu, using the high words of the double tables.
+static uint32_t shortest_digits(float v, int& e10)
+{
+    static const int pow5_float_bitcount = pow5_bitcount - 64;
+
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    const uint32_t ieee_mantissa = bits & ((1u << 23) - 1);
+    const int ieee_exponent = (int)(bits >> 23) & 0xFF;
+
+    int e2;
+    uint32_t m2;
+    if (ieee_exponent == 0)
+    {
+        e2 = 1 - 127 - 23 - 2;
+        m2 = ieee_mantissa;
+    }
+    else
+    {
+        e2 = ieee_exponent - 127 - 23 - 2;
+        m2 = (1u << 23) | ieee_mantissa;
+    }
+    const bool accept_bounds = (m2 & 1) == 0;
+    const uint32_t mv = 4 * m2;
+    const uint32_t mp = 4 * m2 + 2;
+    const uint32_t mm_shift = ieee_mantissa != 0 || ieee_exponent <= 1;
+    const uint32_t mm = 4 * m2 - 1 - mm_shift;
+
+    struct Scale
+    {
+        // (m * factor) >> j, for a 64 bit factor and 32 < j
+        static uint32_t mul_shift(uint32_t m, uint64_t factor, int j)
         {
-            emit_datetime(w, kF(x)[i]);
+            const uint64_t lo = (uint64_t)m * (uint32_t)factor;
+            const uint64_t hi = (uint64_t)m * (uint32_t)(factor >> 32);
+            return (uint32_t)(((lo >> 32) + hi) >> (j - 32));
         }
-        else
+        static uint32_t inv(uint32_t m, uint32_t q, int j) { return mul_shift(m, pow5_tables.inv_split[q][1] + 1, j); }
+        static uint32_t pow(uint32_t m, uint32_t i, int j) { return mul_shift(m, pow5_tables.split[i][1], j); }
+    };
+
+    uint32_t vr, vp, vm;
+    bool vm_zeros = false;
+    bool vr_zeros = false;
+    int last = 0;
+    if (e2 >= 0)
+    {
+        const uint32_t q = log10_pow2(e2);
+        const int j = -e2 + (int)q + pow5_float_bitcount + pow5_bits(q) - 1;
+        e10 = (int)q;
+        vr = Scale::inv(mv, q, j);
+        vp = Scale::inv(mp, q, j);
+        vm = Scale::inv(mm, q, j);
+        if (q != 0 && (vp - 1) / 10 <= vm / 10)
         {
-            w.StartArray();
-            for (int i = 0; i < x->n; i++)
+            // No digits will be removed below, but rounding needs the one beyond vr
+            const int l = -e2 + (int)q - 1 + pow5_float_bitcount + pow5_bits(q - 1) - 1;
+            last = (int)(Scale::inv(mv, q - 1, l) % 10);
+        }
+        if (q <= 9)
+        {
+            if (mv % 5 == 0)
             {
-                emit_datetime(w, kF(x)[i]);
+                vr_zeros = pow5_factor(mv) >= q;
+            }
+            else if (accept_bounds)
+            {
+                vm_zeros = pow5_factor(mm) >= q;
+            }
+            else
+            {
+                vp -= pow5_factor(mp) >= q;
             }
-            w.EndArray();
         }
     }
     else
     {
-        emit_datetime(w, x->f);
+        const uint32_t q = log10_pow5(-e2);
+        const int i = -e2 - (int)q;
+        const int j = (int)q - (pow5_bits(i) - pow5_float_bitcount);
+        e10 = (int)q + e2;
+        vr = Scale::pow(mv, i, j);
+        vp = Scale::pow(mp, i, j);
+        vm = Scale::pow(mm, i, j);
+        if (q != 0 && (vp - 1) / 10 <= vm / 10)
+        {
+            const int l = (int)q - 1 - (pow5_bits(i + 1) - pow5_float_bitcount);
+            last = (int)(Scale::pow(mv, i + 1, l) % 10);
+        }
+        if (q <= 1)
+        {
+            vr_zeros = true;
+            if (accept_bounds)
+            {
+                vm_zeros = mm_shift == 1;
+            }
+            else
+            {
+                --vp;
+            }
+        }
+        else if (q < 31)
+        {
+            vr_zeros = (mv & ((1u << (q - 1)) - 1)) == 0;
+        }
+    }
+
+    int removed = 0;
+    uint32_t digits;
+    if (vm_zeros || vr_zeros)
+    {
+        for (; vp / 10 > vm / 10; removed++)
+        {
+            vm_zeros &= vm % 10 == 0;
+            vr_zeros &= last == 0;
+            last = (int)(vr % 10);
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+        }
+        if (vm_zeros)
+        {
+            for (; vm % 10 == 0; removed++)
+            {
+                vr_zeros &= last == 0;
+                last = (int)(vr % 10);
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+            }
+        }
+        if (vr_zeros && last == 5 && vr % 2 == 0)
+        {
+            last = 4;    // exactly halfway, round to even
+        }
+        digits = vr + ((vr == vm && (!accept_bounds || !vm_zeros)) || last >= 5);
     }
+    else
+    {
+        for (; vp / 10 > vm / 10; removed++)
+        {
+            last = (int)(vr % 10);
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+        }
+        digits = vr + (vr == vm || last >= 5);
+    }
+    e10 += removed;
+    return digits;
 }
 
-template<typename Writer>
-inline void emit_month(Writer& w, const int n)
+// Writes finite v with the fewest digits which read back as the same float
+static char* format_float(float v, char* p)
 {
-    if (n == ni)
+    if (std::signbit(v))
     {
-        w.Null();
+        *p++ = '-';
+        v = -v;
     }
-    else
+    if (v == 0)
     {
-        int year = n/12+2000;
-        int month = n%12+1;
-        char buff[7 + 1];
-        snprintf(buff, sizeof(buff), "%04d-%02d", year, month);
-        w.String(buff, 7);
+        memcpy(p, "0.0", 3);
+        return p + 3;
     }
+
+    int k;
+    const uint32_t digits = shortest_digits(v, k);
+    return layout_digits(digits, k, p);
 }
 
-template<typename Writer>
-void serialise_month(Writer& w, K x, bool isvec, int i)
+// Writes n as a JSON value, with nulls as null and infinities as strings
+template<typename T>
+static inline char* format_real_value(T n, char* p, char* (*format)(T, char*))
 {
-    if (isvec)
+    if (std::isnan(n))
     {
-        if (i >= 0)
-        {
-            emit_month(w, kI(x)[i]);
-        }
-        else
+        memcpy(p, "null", 4);
+        return p + 4;
+    }
+    else if (std::isinf(n))
+    {
+        return n > 0 ? (char*)memcpy(p, "\"Inf\"", 5) + 5 : (char*)memcpy(p, "\"-Inf\"", 6) + 6;
+    }
+    return format(n, p);
+}
+
+// A whole float or real vector, formatted a chunk at a time, separators and all
+template<typename Writer, typename T>
+void serialise_reals(Writer& w, const T* x, J n, char* (*format)(T, char*))
+{
+    char buff[(double_width + 1) * raw_chunk];
+
+    w.StartArray();
+    for (J i = 0; i < n && w.Continue(i); i += raw_chunk)
+    {
+        const J end = std::min(n, i + raw_chunk);
+        char* p = buff;
+        for (J j = i; j < end; j++)
         {
-            w.StartArray();
-            for (int i = 0; i < x->n; i++)
-            {
-                emit_month(w, kI(x)[i]);
-            }
-            w.EndArray();
+            if (j) *p++ = ',';
+            p = format_real_value(x[j], p, format);
         }
+        w.PutRaw(buff, p - buff);
+    }
+    w.EndArray();
+}
+
+template<typename Writer>
+inline void emit_real(Writer& w, float n)
+{
+    if (std::isnan(n))
+    {
+        w.Null();
+    }
+    else if (std::isinf(n))
+    {
+        w.String(n == INFINITY ? "Inf" : "-Inf");
     }
     else
     {
-        emit_month(w, x->i);
+        char buff[double_width];
+        w.RawValue(buff, format_float(n, buff) - buff, kNumberType);
     }
 }
 
 template<typename Writer>
-inline void emit_minute(Writer& w, const int n)
+inline void emit_double(Writer& w, double n)
 {
-    if (n == ni)
+    if (std::isnan(n))
     {
         w.Null();
     }
+    else if (std::isinf(n))
+    {
+        w.String(n == INFINITY ? "Inf" : "-Inf");
+    }
     else
     {
-        time_t tt=n*60;
-        struct tm timinfo;
-        gmtime_r(&tt, &timinfo);
-        char buff[5 + 1];
-        snprintf(buff, sizeof(buff), "%02d:%02d", timinfo.tm_hour, timinfo.tm_min);
-        w.String(buff, 5);
+        char buff[double_width];
+        w.RawValue(buff, format_double(n, buff) - buff, kNumberType);
     }
 }
 
 template<typename Writer>
-void serialise_minute(Writer& w, K x, bool isvec, int i)
+void serialise_float(Writer& w, K x, bool isvec, J i)
 {
     if (isvec)
     {
         if (i >= 0)
         {
-            emit_minute(w, kI(x)[i]);
+            emit_real(w, kE(x)[i]);
         }
         else
         {
-            w.StartArray();
-            for (int i = 0; i < x->n; i++)
-            {
-                emit_minute(w, kI(x)[i]);
-            }
-            w.EndArray();
+            serialise_reals(w, kE(x), x->n, format_float);
         }
     }
     else
     {
-        emit_minute(w, x->i);
-    }
-}
-
-
-template<typename Writer>
-inline void emit_second(Writer& w, const int n)
-{
-    if (n == ni)
-    {
-        w.Null();
-    }
-    else
-    {
-        time_t tt=n*60;
-        struct tm timinfo;
-        gmtime_r(&tt, &timinfo);
-        char buff[8 + 1];
-        snprintf(buff, sizeof(buff), "%02d:%02d:%02d", timinfo.tm_hour, timinfo.tm_min, timinfo.tm_sec);
-        w.String(buff, 8);
+        emit_real(w, x->e);
     }
 }
 
 template<typename Writer>
-void serialise_second(Writer& w, K x, bool isvec, int i)
+void serialise_double(Writer& w, K x, bool isvec, J i)
 {
     if (isvec)
     {
         if (i >= 0)
         {
-            emit_second(w, kI(x)[i]);
+            emit_double(w, kF(x)[i]);
         }
         else
         {
-            w.StartArray();
-            for (int i = 0; i < x->n; i++)
-            {
-                emit_second(w, kI(x)[i]);
-            }
-            w.EndArray();
+            serialise_reals(w, kF(x), x->n, format_double);
         }
     }
     else
     {
-        emit_second(w, x->i);
+        emit_double(w, x->f);
     }
 }
 
 template<typename Writer>
-inline void emit_guid(Writer& w, const U guid_raw)
+inline void emit_date(Writer& w, int n)
 {
-    static const U null_guid = {0};
-
-    if (memcmp(&guid_raw, &null_guid, sizeof(U)) == 0)
+    if (n == ni)
     {
         w.Null();
     }
     else
     {
-        union {
-            struct {
-                uint32_t data1;
-                uint16_t data2;
-                uint16_t data3;
-                uint16_t data4;
-                uint16_t data5;
-                uint32_t data6;
-            };
-            U raw;
-        } guid;
-
-        guid.raw = guid_raw;
-        char buff[36 + 1];
-        snprintf(buff, sizeof(buff), "%08x-%04x-%04x-%04x-%04x%08x",
-            ntohl(guid.data1), ntohs(guid.data2), ntohs(guid.data3), ntohs(guid.data4),
-            ntohs(guid.data5), ntohl(guid.data6));
-        w.String(buff, 36);
+        time_t tt = (n + 10957) * 8.64e4; // magic, see: https://github.com/kxcontrib/wiki/blob/master/csv.c
+        struct tm timinfo;
+        gmtime_r(&tt, &timinfo);
+        char buff[10+1];
+        snprintf(buff, sizeof(buff), "%04d-%02d-%02d", timinfo.tm_year+1900, timinfo.tm_mon+1, timinfo.tm_mday);
+        w.String(buff, 10);
     }
 }
 
 template<typename Writer>
-void serialise_guid(Writer& w, K x, bool isvec, int i)
+void serialise_date(Writer& w, K x, bool isvec, J i)
 {
     if (isvec)
     {
         if (i >= 0)
         {
-            emit_guid(w, kU(x)[i]);
+            emit_date(w, kI(x)[i]);
         }
         else
         {
             w.StartArray();
-            for (int i = 0; i < x->n; i++)
+            for (J i = 0; i < x->n && w.Continue(i); i++)
             {
-                emit_guid(w, kU(x)[i]);
+                emit_date(w, kI(x)[i]);
             }
             w.EndArray();
         }
     }
     else
     {
-        emit_guid(w, kU(x)[0]);
+        emit_date(w, x->i);
     }
 }
 
-template<typename Writer>
-void serialise_dict(Writer& w, K x, bool isvec, int i)
+// The decimal digits of 0 to 99, two to a number
+struct DecimalPairs
 {
-    const K keys = kK(x)[0];
-    const K values = kK(x)[1];
+    DecimalPairs()
+    {
+        for (int i = 0; i < 100; i++)
+        {
+            pairs[2 * i] = (char)('0' + i / 10);
+            pairs[2 * i + 1] = (char)('0' + i % 10);
+        }
+    }
 
-    #ifndef NDEBUG
-    std::cerr << "Dict. key type:    " << (int)keys->t << std::endl;
-    std::cerr << "Dict. key count:   " << keys->n << std::endl;
+    char pairs[200];
+};
+
+static const DecimalPairs decimal_pairs;
+
+static inline void write_two_digits(unsigned n, char* p)
+{
+    memcpy(p, &decimal_pairs.pairs[2 * n], 2);
+}
+
+// Writes hh:mm:ss for the given second of the day
+static inline void write_time_of_day(unsigned secs, char* p)
+{
+    write_two_digits(secs / 3600, p);
+    p[2] = ':';
+    write_two_digits(secs / 60 % 60, p + 3);
+    p[5] = ':';
+    write_two_digits(secs % 60, p + 6);
+}
+
+// Writes the 12 characters of time n (not null) to buff, which has room for 13
+static void format_time(int n, char* buff)
+{
+    time_t tt = n / 1000;
+    struct tm timinfo;
+    gmtime_r(&tt, &timinfo);
+    snprintf(buff, 12+1, "%02d:%02d:%02d.%03d", timinfo.tm_hour, timinfo.tm_min, timinfo.tm_sec, n % 1000);
+}
+
+// Writes the 29 characters of timestamp n (not null) to buff, which has room for 30
+static void format_timestamp(long long n, char* buff)
+{
+    // Whole seconds rounded down, so that times before 2000 keep a positive fraction
+    const long long rem = n % 1000000000;
+    const long long secs = n / 1000000000 - (rem < 0);
+    time_t tt = secs + 10957 * 86400LL; // magic, see: https://github.com/kxcontrib/wiki/blob/master/csv.c
+    struct tm timinfo;
+    gmtime_r(&tt, &timinfo);
+    snprintf(buff, 29+1,
+        "%04d-%02d-%02dD%02d:%02d:%02d.%09lld",
+        timinfo.tm_year+1900, timinfo.tm_mon+1, timinfo.tm_mday,
+        timinfo.tm_hour, timinfo.tm_min, timinfo.tm_sec, rem < 0 ? rem + 1000000000 : rem);
+}
+
+// Writes the 23 characters of datetime n (not null) to buff, which has room for 24
+static void format_datetime(double n, char* buff)
+{
+    time_t tt = (n + 10957) * 8.64e4;
+    struct tm timinfo;
+    gmtime_r(&tt, &timinfo);
+    snprintf(buff, 23+1,
+        "%04d-%02d-%02dT%02d:%02d:%02d.%03lld",
+        timinfo.tm_year+1900, timinfo.tm_mon+1, timinfo.tm_mday,
+        timinfo.tm_hour, timinfo.tm_min, timinfo.tm_sec, (long long)(round(n*8.64e7))%1000);
+}
+
+// Formats the values of a temporal column one after another, as the emit
+// functions would (quoted, and nulls as null), keeping the text of the last
+// one. A value in the same second as the last only rewrites the fraction, and
+// one on the same day only the time of day, so the calendar is worked out once
+// a day: neighbouring ticks in a sorted column mostly take the first path.
+// What is written never depends on the values before, only the work done.
+class TemporalCursor
+{
+public:
+    // Longest output, a quoted timestamp
+    static const int width = 29 + 2;
+
+    TemporalCursor() : kind(0), day(0), second(0)
+    {
+    }
+
+    char* timestamp(long long n, char* p)
+    {
+        if (n == nj) return null(p);
+
+        const long long rem = n % 1000000000;
+        const long long secs = n / 1000000000 - (rem < 0);
+        const long long d = secs / 86400 - (secs % 86400 < 0);
+        if (kind != KP || d != day)
+        {
+            format_timestamp(n, text);
+            kind = KP;
+            day = d;
+            second = secs;
+        }
+        else
+        {
+            if (secs != second)
+            {
+                write_time_of_day(secs - d * 86400, text + 11);
+                second = secs;
+            }
+            write_nanos(rem < 0 ? rem + 1000000000 : rem, text + 20);
+        }
+        return quoted(29, p);
+    }
+
+    char* datetime(double n, char* p)
+    {
+        if (std::isnan(n)) return null(p);
+
+        // Only years 0000 to 9999 keep to the layout, and times before 2000
+        // have a negative fraction, so those are always formatted in full
+        const double s = (n + 10957) * 8.64e4;
+        const long long ms = s > -62167219200.0 && s < 253402300800.0 ? (long long)(round(n*8.64e7))%1000 : -1;
+        if (ms < 0)
+        {
+            format_datetime(n, text);
+            kind = 0;
+            return quoted(23, p);
+        }
+
+        const long long tt = (time_t)s;
+        const long long d = tt / 86400 - (tt % 86400 < 0);
+        if (kind != KZ || d != day)
+        {
+            format_datetime(n, text);
+            kind = KZ;
+            day = d;
+            second = tt;
+        }
+        else
+        {
+            if (tt != second)
+            {
+                write_time_of_day(tt - d * 86400, text + 11);
+                second = tt;
+            }
+            write_millis(ms, text + 20);
+        }
+        return quoted(23, p);
+    }
+
+    char* time(int n, char* p)
+    {
+        if (n == ni) return null(p);
+
+        if (n < 0)
+        {
+            format_time(n, text);
+            kind = 0;
+            return quoted(12, p);
+        }
+
+        const int secs = n / 1000;
+        if (kind != KT || secs != second)
+        {
+            write_time_of_day(secs % 86400, text);
+            text[8] = '.';
+            kind = KT;
+            second = secs;
+        }
+        write_millis(n % 1000, text + 9);
+        return quoted(12, p);
+    }
+
+private:
+    static char* null(char* p)
+    {
+        memcpy(p, "null", 4);
+        return p + 4;
+    }
+
+    static void write_nanos(unsigned n, char* p)
+    {
+        *p = (char)('0' + n / 100000000);
+        n %= 100000000;
+        write_two_digits(n / 1000000, p + 1);
+        write_two_digits(n / 10000 % 100, p + 3);
+        write_two_digits(n / 100 % 100, p + 5);
+        write_two_digits(n % 100, p + 7);
+    }
+
+    static void write_millis(unsigned n, char* p)
+    {
+        *p = (char)('0' + n / 100);
+        write_two_digits(n % 100, p + 1);
+    }
+
+    char* quoted(int length, char* p) const
+    {
+        *p = '"';
+        memcpy(p + 1, text, length);
+        p[length + 1] = '"';
+        return p + length + 2;
+    }
+
+    char text[29+1];
+    int kind;           // the type text holds a value of, or 0
+    long long day;      // the day of that value, and its second
+    long long second;
+};
+
+// A whole temporal vector, formatted a chunk at a time through a cursor
+template<typename Writer, typename T>
+void serialise_temporals(Writer& w, const T* x, J n, char* (TemporalCursor::*format)(T, char*))
+{
+    char buff[(TemporalCursor::width + 1) * raw_chunk];
+    TemporalCursor cursor;
+
+    w.StartArray();
+    for (J i = 0; i < n && w.Continue(i); i += raw_chunk)
+    {
+        const J end = std::min(n, i + raw_chunk);
+        char* p = buff;
+        for (J j = i; j < end; j++)
+        {
+            if (j) *p++ = ',';
+            p = (cursor.*format)(x[j], p);
+        }
+        w.PutRaw(buff, p - buff);
+    }
+    w.EndArray();
+}
+
+template<typename Writer>
+inline void emit_time(Writer& w, int n)
+{
+    if (n == ni)
+    {
+        w.Null();
+    }
+    else
+    {
+        char buff[12+1];
+        format_time(n, buff);
+        w.String(buff, 12);
+    }
+}
+
+template<typename Writer>
+void serialise_time(Writer& w, K x, bool isvec, J i)
+{
+    if (isvec)
+    {
+        if (i >= 0)
+        {
+            emit_time(w, kI(x)[i]);
+        }
+        else
+        {
+            serialise_temporals(w, kI(x), x->n, &TemporalCursor::time);
+        }
+    }
+    else
+    {
+        emit_time(w, x->i);
+    }
+}
+
+template<typename Writer>
+inline void emit_timestamp(Writer& w, long long n)
+{
+    if (n == nj)
+    {
+        w.Null();
+    }
+    else
+    {
+        char buff[29+1];
+        format_timestamp(n, buff);
+        w.String(buff, 29);
+    }
+}
+
+template<typename Writer>
+void serialise_timestamp(Writer& w, K x, bool isvec, J i)
+{
+    if (isvec)
+    {
+        if (i >= 0)
+        {
+            emit_timestamp(w, kJ(x)[i]);
+        }
+        else
+        {
+            serialise_temporals(w, kJ(x), x->n, &TemporalCursor::timestamp);
+        }
+    }
+    else
+    {
+        emit_timestamp(w, x->j);
+    }
+}
+
+
+// Writes a timespan as q's string would (eg: -1D02:03:04.000000005, 0Wn),
+// returning the end of the text
+static char* format_timespan(long long n, char* p)
+{
+    if (n == wj || n == -wj)
+    {
+        const char* inf = n == wj ? "0Wn" : "-0Wn";
+        memcpy(p, inf, strlen(inf));
+        return p + strlen(inf);
+    }
+
+    const unsigned long long u = n < 0 ? 0ULL - n : n;
+    const unsigned long long secs = u / 1000000000;
+    const int written = sprintf(p, "%s%lluD%02d:%02d:%02d.%09d", n < 0 ? "-" : "",
+        secs / 86400, (int)(secs / 3600 % 24), (int)(secs / 60 % 60), (int)(secs % 60), (int)(u % 1000000000));
+    return p + written;
+}
+
+template<typename Writer>
+inline void emit_timespan(Writer& w, long long n)
+{
+    if (n == nj)
+    {
+        w.Null();
+    }
+    else
+    {
+        // As q's string does, days and all (no struct tm, whose tm_yday
+        // would wrap), without calling into q
+        char buff[32];
+        w.String(buff, format_timespan(n, buff) - buff);
+    }
+}
+
+template<typename Writer>
+void serialise_timespan(Writer& w, K x, bool isvec, J i)
+{
+    if (isvec)
+    {
+        if (i >= 0)
+        {
+            emit_timespan(w, kJ(x)[i]);
+        }
+        else
+        {
+            w.StartArray();
+            for (J i = 0; i < x->n && w.Continue(i); i++)
+            {
+                emit_timespan(w, kJ(x)[i]);
+            }
+            w.EndArray();
+        }
+    }
+    else
+    {
+        emit_timespan(w, x->j);
+    }
+}
+
+template<typename Writer>
+inline void emit_datetime(Writer& w, double n)
+{
+    if (std::isnan(n))
+    {
+        w.Null();
+    }
+    else
+    {
+        char buff[23+1];
+        format_datetime(n, buff);
+        w.String(buff, 23);
+    }
+}
+
+template<typename Writer>
+void serialise_datetime(Writer& w, K x, bool isvec, J i)
+{
+    if (isvec)
+    {
+        if (i >= 0)
+        {
+            emit_datetime(w, kF(x)[i]);
+        }
+        else
+        {
+            serialise_temporals(w, kF(x), x->n, &TemporalCursor::datetime);
+        }
+    }
+    else
+    {
+        emit_datetime(w, x->f);
+    }
+}
+
+template<typename Writer>
+inline void emit_month(Writer& w, const int n)
+{
+    if (n == ni)
+    {
+        w.Null();
+    }
+    else
+    {
+        int year = n/12+2000;
+        int month = n%12+1;
+        char buff[7 + 1];
+        snprintf(buff, sizeof(buff), "%04d-%02d", year, month);
+        w.String(buff, 7);
+    }
+}
+
+template<typename Writer>
+void serialise_month(Writer& w, K x, bool isvec, J i)
+{
+    if (isvec)
+    {
+        if (i >= 0)
+        {
+            emit_month(w, kI(x)[i]);
+        }
+        else
+        {
+            w.StartArray();
+            for (J i = 0; i < x->n && w.Continue(i); i++)
+            {
+                emit_month(w, kI(x)[i]);
+            }
+            w.EndArray();
+        }
+    }
+    else
+    {
+        emit_month(w, x->i);
+    }
+}
+
+template<typename Writer>
+inline void emit_minute(Writer& w, const int n)
+{
+    if (n == ni)
+    {
+        w.Null();
+    }
+    else
+    {
+        time_t tt=n*60;
+        struct tm timinfo;
+        gmtime_r(&tt, &timinfo);
+        char buff[5 + 1];
+        snprintf(buff, sizeof(buff), "%02d:%02d", timinfo.tm_hour, timinfo.tm_min);
+        w.String(buff, 5);
+    }
+}
+
+template<typename Writer>
+void serialise_minute(Writer& w, K x, bool isvec, J i)
+{
+    if (isvec)
+    {
+        if (i >= 0)
+        {
+            emit_minute(w, kI(x)[i]);
+        }
+        else
+        {
+            w.StartArray();
+            for (J i = 0; i < x->n && w.Continue(i); i++)
+            {
+                emit_minute(w, kI(x)[i]);
+            }
+            w.EndArray();
+        }
+    }
+    else
+    {
+        emit_minute(w, x->i);
+    }
+}
+
+
+template<typename Writer>
+inline void emit_second(Writer& w, const int n)
+{
+    if (n == ni)
+    {
+        w.Null();
+    }
+    else
+    {
+        time_t tt=n*60;
+        struct tm timinfo;
+        gmtime_r(&tt, &timinfo);
+        char buff[8 + 1];
+        snprintf(buff, sizeof(buff), "%02d:%02d:%02d", timinfo.tm_hour, timinfo.tm_min, timinfo.tm_sec);
+        w.String(buff, 8);
+    }
+}
+
+template<typename Writer>
+void serialise_second(Writer& w, K x, bool isvec, J i)
+{
+    if (isvec)
+    {
+        if (i >= 0)
+        {
+            emit_second(w, kI(x)[i]);
+        }
+        else
+        {
+            w.StartArray();
+            for (J i = 0; i < x->n && w.Continue(i); i++)
+            {
+                emit_second(w, kI(x)[i]);
+            }
+            w.EndArray();
+        }
+    }
+    else
+    {
+        emit_second(w, x->i);
+    }
+}
+
+static inline bool is_null_guid(const U& guid)
+{
+    static const U null_guid = {0};
+    return memcmp(&guid, &null_guid, sizeof(U)) == 0;
+}
+
+// Writes the 36 characters of a guid (8-4-4-4-12 hex digits) to out
+static inline void format_guid(const U& guid, char* out)
+{
+    char hex[32];
+    hex_encode(guid.g, 16, hex);
+
+    memcpy(out, hex, 8);
+    out[8] = '-';
+    memcpy(out + 9, hex + 8, 4);
+    out[13] = '-';
+    memcpy(out + 14, hex + 12, 4);
+    out[18] = '-';
+    memcpy(out + 19, hex + 16, 4);
+    out[23] = '-';
+    memcpy(out + 24, hex + 20, 12);
+}
+
+template<typename Writer>
+inline void emit_guid(Writer& w, const U guid)
+{
+    if (is_null_guid(guid))
+    {
+        w.Null();
+    }
+    else
+    {
+        char buff[36];
+        format_guid(guid, buff);
+        w.String(buff, 36);
+    }
+}
+
+template<typename Writer>
+void serialise_guid(Writer& w, K x, bool isvec, J i)
+{
+    if (isvec)
+    {
+        if (i >= 0)
+        {
+            emit_guid(w, kU(x)[i]);
+        }
+        else
+        {
+            // Formatted a chunk at a time, separators and all
+            char buff[39 * raw_chunk];
+
+            w.StartArray();
+            for (J i = 0; i < x->n && w.Continue(i); i += raw_chunk)
+            {
+                const J end = std::min(x->n, i + raw_chunk);
+                char* p = buff;
+                for (J j = i; j < end; j++)
+                {
+                    if (j) *p++ = ',';
+                    if (is_null_guid(kU(x)[j]))
+                    {
+                        memcpy(p, "null", 4);
+                        p += 4;
+                    }
+                    else
+                    {
+                        *p++ = '"';
+                        format_guid(kU(x)[j], p);
+                        p += 36;
+                        *p++ = '"';
+                    }
+                }
+                w.PutRaw(buff, p - buff);
+            }
+            w.EndArray();
+        }
+    }
+    else
+    {
+        emit_guid(w, kU(x)[0]);
+    }
+}
+
+template<typename Writer>
+void serialise_dict(Writer& w, K x, bool isvec, J i)
+{
+    const K keys = kK(x)[0];
+    const K values = kK(x)[1];
+
+    #ifndef NDEBUG
+    std::cerr << "Dict. key type:    " << (int)keys->t << std::endl;
+    std::cerr << "Dict. key count:   " << keys->n << std::endl;
     std::cerr << "Dict. value count: " << values->n << std::endl;
     std::cerr << "Dict. value type:  " << (int)values->t << std::endl;
     #endif
 
-    if (keys->t == XT && values->t == XT)
+    if (keys->t == XT && values->t == XT)
+    {
+        serialise_keyed_table(w, keys, values);
+    }
+    else if (w.opts.canonical && keys->t == KS)
+    {
+        std::vector<J> order(keys->n);
+        for (J i = 0; i < keys->n; i++) order[i] = i;
+        std::stable_sort(order.begin(), order.end(), SymbolLess(keys));
+
+        w.StartObject();
+        for (J j = 0; j < keys->n && w.Continue(j); j++)
+        {
+            serialise_atom(w, keys, order[j]);
+            serialise_atom(w, values, order[j]);
+        }
+        w.EndObject();
+    }
+    else
+    {
+        w.StartObject();
+        for (J i = 0; i < keys->n && w.Continue(i); i++)
+        {
+            serialise_atom(w, keys, i);
+            serialise_atom(w, values, i);
+        }
+        w.EndObject();
+    }
+}
+
+// How each column of a table is written, worked out once for all its rows
+// rather than per cell. A general list column whose items are lists of one
+// type (eg: strings) goes straight to the serialiser of that type, as long
+// as each item turns out to be of it. Timestamp, datetime and time columns
+// go through a cursor of their own, from row to row, and long columns given
+// a scale are written as decimals. Canonical plans write the columns in
+// order of name.
+template<typename Writer>
+class TablePlan
+{
+public:
+    TablePlan(K kkeys, K kvalues, K vkeys, K vvalues, const Options& opts = default_options)
+        : trim(opts.trim)
+    {
+        std::vector<std::pair<S, K> > order;
+        for (J j = 0; kkeys && j < kkeys->n; j++) order.push_back(std::make_pair(kS(kkeys)[j], kK(kvalues)[j]));
+        for (J j = 0; j < vkeys->n; j++) order.push_back(std::make_pair(kS(vkeys)[j], kK(vvalues)[j]));
+        if (opts.canonical) std::stable_sort(order.begin(), order.end(), member_less);
+
+        for (size_t j = 0; j < order.size(); j++) add(order[j].first, order[j].second, scale_of(opts, order[j].first));
+    }
+
+    // The given names and columns, in the order given
+    TablePlan(const std::vector<std::pair<S, K> >& order)
+        : trim(false)
+    {
+        for (size_t j = 0; j < order.size(); j++) add(order[j].first, order[j].second, -1);
+    }
+
+    // Row i, as serialise_row
+    void row(Writer& w, J i) const
+    {
+        w.StartObject();
+        for (size_t j = 0; j < columns.size(); j++)
+        {
+            const Column& c = columns[j];
+            w.String(c.name);
+            if (c.scale >= 0) emit_scaled(w, kJ(c.values)[i], c.scale, trim);
+            else if (c.temporal) emit_temporal(w, c, i);
+            else if (! c.item_type) c.serialise(w, c.values, c.values->t >= 0, i);
+            else if (kK(c.values)[i]->t == c.item_type) c.serialise(w, kK(c.values)[i], true, -1);
+            else serialise_atom(w, kK(c.values)[i]);
+        }
+        w.EndObject();
+    }
+
+private:
+    struct Column
+    {
+        S name;
+        K values;
+        Serialiser<Writer> serialise;
+        int item_type;  // of the items serialise is for, rather than the column (0)
+        bool temporal;  // written through cursor rather than serialise
+        mutable TemporalCursor cursor;
+        int scale;      // decimal places of a scaled long column, or -1
+    };
+
+    // Cell i of a timestamp, datetime or time column, carrying on from the row before
+    static void emit_temporal(Writer& w, const Column& c, J i)
+    {
+        char buff[TemporalCursor::width];
+        char* end;
+        switch (c.values->t)
+        {
+            case (KP):  end = c.cursor.timestamp(kJ(c.values)[i], buff); break;
+            case (KZ):  end = c.cursor.datetime(kF(c.values)[i], buff); break;
+            default:    end = c.cursor.time(kI(c.values)[i], buff); break;
+        }
+        w.RawValue(buff, end - buff, kStringType);
+    }
+
+    void add(S name, K values, int scale)
+    {
+        Column c = { name, values, serialiser_of<Writer>(values->t), 0, values->t == KP || values->t == KZ || values->t == KT,
+                     TemporalCursor(), values->t == KJ ? scale : -1 };
+
+        if (values->t == 0 && values->n > 0)
+        {
+            const int t = kK(values)[0]->t;
+            if (t > 0 && t < 20)
+            {
+                c.serialise = serialiser_of<Writer>(t);
+                c.item_type = t;
+            }
+        }
+        columns.push_back(c);
+    }
+
+    std::vector<Column> columns;
+    const bool trim;
+};
+
+template<typename Writer>
+void serialise_keyed_table(Writer& w, K keys, K values)
+{
+    const K kdict = keys->k;
+    const K kkeys = kK(kdict)[0];
+    const K kvalues = kK(kdict)[1];
+
+    const K vdict = values->k;
+    const K vkeys = kK(vdict)[0];
+    const K vvalues = kK(vdict)[1];
+
+    const J krows = kK(kvalues)[0]->n;
+    const J vrows = kK(vvalues)[0]->n;
+
+    assert(vrows == krows);
+
+    #ifndef NDEBUG
+    std::cerr << "Keyed Table" << std::endl;
+    std::cerr << "Key count:  " << kkeys->n << std::endl;
+    std::cerr << "Key length: " << kvalues->n << std::endl;
+    std::cerr << "Key rows:   " << krows << std::endl;
+
+    std::cerr << "V column count: " << vkeys->n << std::endl;
+    std::cerr << "V length:       " << vvalues->n << std::endl;
+    std::cerr << "V rows:         " << vrows << std::endl;
+    #endif
+
+    if (w.opts.compact)
+    {
+        serialise_compact_table(w, kkeys, kvalues, vkeys, vvalues);
+        return;
+    }
+
+    // In kdb+, .j.j will serialise a keyed table as a dictionary of key objects to value objects.
+    // However, this is not valid JSON. Instead, we serialise it as if it was an unkeyed table.
+    const TablePlan<Writer> plan(kkeys, kvalues, vkeys, vvalues, w.opts);
+
+    w.StartArray();
+    for (J i = 0; i < krows && w.Check(); i++)
+    {
+        plan.row(w, i);
+    }
+    w.EndArray();
+}
+
+// A row as an object of the key columns followed by the value columns.
+// Unkeyed tables have no key columns (kkeys is null).
+template<typename Writer>
+void serialise_row(Writer& w, K kkeys, K kvalues, K vkeys, K vvalues, J i)
+{
+    if (w.opts.canonical)
+    {
+        std::vector<std::pair<S, K> > members;
+        for (J j = 0; kkeys && j < kkeys->n; j++) members.push_back(std::make_pair(kS(kkeys)[j], kK(kvalues)[j]));
+        for (J j = 0; j < vkeys->n; j++) members.push_back(std::make_pair(kS(vkeys)[j], kK(vvalues)[j]));
+        std::stable_sort(members.begin(), members.end(), member_less);
+
+        w.StartObject();
+        for (size_t j = 0; j < members.size(); j++)
+        {
+            w.String(members[j].first);
+            serialise_atom(w, members[j].second, i);
+        }
+        w.EndObject();
+        return;
+    }
+
+    w.StartObject();
+    if (kkeys)
+    {
+        for (J j = 0; j < kkeys->n; j++)
+        {
+            serialise_atom(w, kkeys, j);
+            serialise_atom(w, kK(kvalues)[j], i);
+        }
+    }
+    for (J j = 0; j < vkeys->n; j++)
+    {
+        serialise_atom(w, vkeys, j);
+        serialise_atom(w, kK(vvalues)[j], i);
+    }
+    w.EndObject();
+}
+
+template<typename Writer>
+void serialise_table(Writer& w, K x, bool isvec, J i)
+{
+    const K dict = x->k;
+    const K keys = kK(dict)[0];
+    const K values = kK(dict)[1];
+
+    if (i >= 0)
+    {
+        serialise_row(w, 0, 0, keys, values, i);
+    }
+    else if (w.opts.compact)
+    {
+        serialise_compact_table(w, 0, 0, keys, values);
+    }
+    else
+    {
+        const J rows = kK(values)[0]->n;
+        const TablePlan<Writer> plan(0, 0, keys, values, w.opts);
+
+        w.StartArray();
+        for (J i = 0; i < rows && w.Check(); i++)
+        {
+            plan.row(w, i);
+        }
+        w.EndArray();
+    }
+}
+
+// Compact encoding of a column: symbols as a list of distinct values and
+// codes into it, sorted longs and timestamps as a base and deltas between
+// successive values (unless they hold infinities), anything else as a plain
+// array. Scaled long columns are a plain array of decimals.
+template<typename Writer>
+void serialise_compact_column(Writer& w, K x, int scale)
+{
+    if (x->t == KS)
+    {
+        std::unordered_map<S, J> codes;
+        std::vector<S> symbols;
+
+        w.StartObject();
+        w.String("codes");
+        w.StartArray();
+        for (J i = 0; i < x->n && w.Continue(i); i++)
+        {
+            const S s = kS(x)[i];
+            std::pair<std::unordered_map<S, J>::iterator, bool> it = codes.insert(std::make_pair(s, (J)symbols.size()));
+            if (it.second) symbols.push_back(s);
+            w.Int64(it.first->second);
+        }
+        w.EndArray();
+        w.String("symbols");
+        w.StartArray();
+        for (size_t i = 0; i < symbols.size(); i++)
+        {
+            w.String(symbols[i]);
+        }
+        w.EndArray();
+        w.EndObject();
+        return;
+    }
+
+    if (x->t == KJ && scale >= 0)
+    {
+        serialise_scaled(w, x, scale);
+        return;
+    }
+
+    if ((x->t == KJ || x->t == KP) && x->n > 0 && kJ(x)[0] != nj && kJ(x)[0] != -wj)
+    {
+        // Nulls sort first, so a sorted column without a leading null has none,
+        // and likewise -0W. Columns with 0W, or a difference too big for a long,
+        // are left as plain arrays (where longs write 0W as null).
+        bool sorted = kJ(x)[0] != wj;
+        for (J i = 1; i < x->n && sorted; i++)
+        {
+            const unsigned long long d = (unsigned long long)kJ(x)[i] - (unsigned long long)kJ(x)[i - 1];
+            sorted = kJ(x)[i] >= kJ(x)[i - 1] && kJ(x)[i] != wj && d <= (unsigned long long)wj;
+        }
+
+        if (sorted)
+        {
+            w.StartObject();
+            w.String("base");
+            serialise_atom(w, x, 0);
+            w.String("deltas");
+            w.StartArray();
+            for (J i = 1; i < x->n && w.Continue(i); i++)
+            {
+                w.Int64(kJ(x)[i] - kJ(x)[i - 1]);
+            }
+            w.EndArray();
+            w.EndObject();
+            return;
+        }
+    }
+
+    serialise_atom(w, x);
+}
+
+template<typename Writer>
+void serialise_compact_table(Writer& w, K kkeys, K kvalues, K vkeys, K vvalues)
+{
+    const J rows = vkeys->n ? kK(vvalues)[0]->n : kkeys ? kK(kvalues)[0]->n : 0;
+
+    // The key columns followed by the value columns, or in order of name
+    std::vector<std::pair<S, K> > columns;
+    for (J j = 0; kkeys && j < kkeys->n; j++) columns.push_back(std::make_pair(kS(kkeys)[j], kK(kvalues)[j]));
+    for (J j = 0; j < vkeys->n; j++) columns.push_back(std::make_pair(kS(vkeys)[j], kK(vvalues)[j]));
+    if (w.opts.canonical) std::stable_sort(columns.begin(), columns.end(), member_less);
+
+    w.StartObject();
+    w.String("columns");
+    w.StartArray();
+    for (size_t j = 0; j < columns.size(); j++) w.String(columns[j].first);
+    w.EndArray();
+
+    w.String("rows");
+    w.Int64(rows);
+
+    w.String("data");
+    w.StartArray();
+    for (size_t j = 0; j < columns.size(); j++) serialise_compact_column(w, columns[j].second, scale_of(w.opts, columns[j].first));
+    w.EndArray();
+    w.EndObject();
+}
+
+template<typename Writer>
+Serialiser<Writer> serialiser_of(int t)
+{
+    switch (t < 0 ? -t : t)
+    {
+        case (0):   return serialise_list<Writer>;
+        case (KS):  return serialise_sym<Writer>;
+        case (KC):  return serialise_char<Writer>;
+        case (KB):  return serialise_bool<Writer>;
+        case (KG):  return serialise_byte<Writer>;
+        case (KH):  return serialise_short<Writer>;
+        case (KI):  return serialise_int<Writer>;
+        case (KJ):  return serialise_long<Writer>;
+        case (KE):  return serialise_float<Writer>;
+        case (KF):  return serialise_double<Writer>;
+        case (XT):  return serialise_table<Writer>;
+        case (XD):  return serialise_dict<Writer>;
+        case (KD):  return serialise_date<Writer>;
+        case (KT):  return serialise_time<Writer>;
+        case (KP):  return serialise_timestamp<Writer>;
+        case (KZ):  return serialise_datetime<Writer>;
+        case (UU):  return serialise_guid<Writer>;
+        case (KM):  return serialise_month<Writer>;
+        case (KN):  return serialise_timespan<Writer>;
+        case (KU):  return serialise_minute<Writer>;
+        case (KV):  return serialise_second<Writer>;
+
+        // MAGIC: Enumerated symbols (eg: splayed tables)
+        case (20):  return serialise_enum_sym<Writer>;
+
+        default:    return serialise_unhandled<Writer>;
+    }
+}
+
+template<typename Writer>
+void serialise_unhandled(Writer& w, K x, bool isvec, J i)
+{
+    #ifndef NDEBUG
+    std::cerr << "WARNING: unhandled atom (" << (int)x->t << ")" << std::endl;
+    #endif
+    w.Null();
+}
+
+template<typename Writer>
+void serialise_atom(Writer& w, const K x, J i)
+{
+    bool isvec = x->t >= 0;
+
+    serialiser_of<Writer>(x->t)(w, x, isvec, i);
+}
+
+extern "C" K tojson(K x)
+{
+    StringBuffer buffer;
+    JsonWriter<StringBuffer> writer(buffer);
+
+    serialise_atom(writer, x);
+
+    size_t len = buffer.GetLength();
+    const char* str = buffer.GetString();
+
+    // Marshal to kdb
+    K ser = kpn((char*)str, len);
+
+    return ser;
+}
+
+// Reads the integer value i of an options dictionary (or its atom v),
+// failing for other types or values outside [lo, hi]
+static bool read_integer(K values, K v, J i, J lo, J hi, J& n)
+{
+    const int t = v ? v->t : -values->t;
+    if (t == -KJ) n = v ? v->j : kJ(values)[i];
+    else if (t == -KI) n = v ? v->i : kI(values)[i];
+    else if (t == -KH) n = v ? v->h : kH(values)[i];
+    else return false;
+    return n >= lo && n <= hi;
+}
+
+// Reads a dictionary of option names to values into opts, returning the
+// name of a bad option (or 0). :: gives the defaults.
+static S read_options(K x, Options& opts)
+{
+    if (x->t == 101) return 0;
+    if (x->t != XD || kK(x)[0]->t != KS) return (S)"options";
+
+    const K names = kK(x)[0];
+    const K values = kK(x)[1];
+    const J max = 0x7fffffffffffffffLL;
+
+    for (J i = 0; i < names->n; i++)
+    {
+        const S name = kS(names)[i];
+        const K v = values->t == 0 ? kK(values)[i] : 0;
+        const int t = v ? v->t : -values->t;
+
+        J n;
+        if (strcmp(name, "compact") == 0)
+        {
+            if (t != -KB) return name;
+            opts.compact = v ? v->g : kG(values)[i];
+        }
+        else if (strcmp(name, "deflate") == 0)
+        {
+            if (t != -KB) return name;
+            opts.deflate = v ? v->g : kG(values)[i];
+        }
+        else if (strcmp(name, "frame") == 0)
+        {
+            if (! read_integer(values, v, i, 0, max, n)) return name;
+            opts.frame = n;
+        }
+        else if (strcmp(name, "level") == 0)
+        {
+            if (! read_integer(values, v, i, -1, 9, n)) return name;
+            opts.level = (int)n;
+        }
+        else if (strcmp(name, "maxbytes") == 0)
+        {
+            if (! read_integer(values, v, i, 0, max, n)) return name;
+            opts.maxbytes = n;
+        }
+        else if (strcmp(name, "maxdepth") == 0)
+        {
+            if (! read_integer(values, v, i, 0, max, n)) return name;
+            opts.maxdepth = n;
+        }
+        else if (strcmp(name, "maxtime") == 0)
+        {
+            if (t != -KN) return name;
+            opts.maxtime = v ? v->j : kJ(values)[i];
+            if (opts.maxtime < 0) return name;
+        }
+        else if (strcmp(name, "truncate") == 0)
+        {
+            if (t != -KB) return name;
+            opts.truncate = v ? v->g : kG(values)[i];
+        }
+        else if (strcmp(name, "canonical") == 0)
+        {
+            if (t != -KB) return name;
+            opts.canonical = v ? v->g : kG(values)[i];
+        }
+        else if (strcmp(name, "scale") == 0)
+        {
+            if (! v || v->t != XD || kK(v)[0]->t != KS) return name;
+            const K places = kK(v)[1];
+            if (places->t != KJ && places->t != KI && places->t != KH) return name;
+            for (J k = 0; k < places->n; k++)
+            {
+                if (! read_integer(places, 0, k, 0, max_scale, n)) return name;
+            }
+            opts.scale = v;
+        }
+        else if (strcmp(name, "trim") == 0)
+        {
+            if (t != -KB) return name;
+            opts.trim = v ? v->g : kG(values)[i];
+        }
+        else if (strcmp(name, "bytes") == 0)
+        {
+            if (t != -KS) return name;
+            const S e = v ? v->s : kS(values)[i];
+            if (strcmp(e, "array") == 0) opts.bytes = Options::bytes_array;
+            else if (strcmp(e, "hex") == 0) opts.bytes = Options::bytes_hex;
+            else if (strcmp(e, "base64") == 0) opts.bytes = Options::bytes_base64;
+            else return name;
+        }
+        else
+        {
+            return name;
+        }
+    }
+    return 0;
+}
+
+extern "C" K tojsonopt(K options, K x)
+{
+    Options opts;
+    const S bad = read_options(options, opts);
+    if (bad) return krr(bad);
+
+    StringBuffer buffer;
+    JsonWriter<StringBuffer> writer(buffer, opts);
+
+    serialise_atom(writer, x);
+
+    const K error = budget_error(writer);
+    if (error) return error;
+
+    return budget_result(writer, kpn((char*)buffer.GetString(), buffer.GetLength()));
+}
+
+/*
+    Batches
+
+    tojsonbatch serialises every item of a list as tojson would, spread
+    over a pool of threads. Each thread writes its items one after another
+    into a buffer of its own, and only the main thread makes q objects.
+*/
+
+// Items handed to a thread at a time
+static const J batch_block = 64;
+
+struct BatchWorker
+{
+    BatchWorker(K x, K syms, std::atomic<J>& next) : x(x), syms(syms), next(next) {}
+
+    void run()
+    {
+        JsonWriter<StringBuffer> writer(buffer);
+        writer.syms = syms;
+        for (J first = next.fetch_add(batch_block); first < x->n; first = next.fetch_add(batch_block))
+        {
+            const J end = std::min(x->n, first + batch_block);
+            for (J i = first; i < end; i++)
+            {
+                writer.Reset(buffer);
+                if (x->t == 0) serialise_atom(writer, kK(x)[i]);
+                else serialise_atom(writer, x, i);
+                items.push_back(i);
+                ends.push_back(buffer.GetSize());
+            }
+        }
+    }
+
+    const K x;
+    const K syms;
+    std::atomic<J>& next;
+    StringBuffer buffer;        // the text of every item, one after another
+    std::vector<J> items;       // the index of each item written
+    std::vector<size_t> ends;   // and where its text ends
+};
+
+// Whether x holds an enumeration of sym anywhere within it
+static bool has_enum(K x)
+{
+    if (x->t == 20 || x->t == -20) return true;
+    if (x->t == XT) return has_enum(x->k);
+    if (x->t == 0 || x->t == XD)
+    {
+        for (J i = 0; i < x->n; i++)
+        {
+            if (has_enum(kK(x)[i])) return true;
+        }
+    }
+    return false;
+}
+
+extern "C" K tojsonbatch(K x)
+{
+    if (x->t < 0 || x->t >= 20) return krr((S)"type");
+
+    // A thread per core, but none with less than a block of items
+    size_t nthreads = std::thread::hardware_concurrency();
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > (size_t)(x->n / batch_block) + 1) nthreads = x->n / batch_block + 1;
+
+    // Workers cannot call into q, so sym is looked up for them, but only
+    // when there is an enumeration to resolve
+    const K syms = has_enum(x) ? k(0, (S)"sym", (K)0) : 0;
+    std::atomic<J> next(0);
+    std::deque<BatchWorker> pool;  // (which never moves them, buffers being uncopyable)
+
+    // Nothing may throw into q. A pool cut short by memory, or workers
+    // which could not be started, leave their blocks to the others, and to
+    // the main thread in the end.
+    try
+    {
+        for (size_t i = 0; i < nthreads; i++) pool.emplace_back(x, syms, next);
+    }
+    catch (...)
+    {
+        if (pool.empty())
+        {
+            if (syms) r0(syms);
+            return krr((S)"wsfull");
+        }
+    }
+
+    std::vector<std::thread> workers;
+    try
+    {
+        workers.reserve(pool.size() - 1);
+        for (size_t i = 1; i < pool.size(); i++)
+        {
+            workers.push_back(std::thread(&BatchWorker::run, &pool[i]));
+        }
+    }
+    catch (...)
+    {
+    }
+    pool[0].run();
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+    if (syms) r0(syms);
+
+    K result = ktn(0, x->n);
+    for (size_t i = 0; i < pool.size(); i++)
+    {
+        const char* text = pool[i].buffer.GetString();
+        size_t start = 0;
+        for (size_t j = 0; j < pool[i].items.size(); j++)
+        {
+            kK(result)[pool[i].items[j]] = kpn((S)(text + start), pool[i].ends[j] - start);
+            start = pool[i].ends[j];
+        }
+    }
+    return result;
+}
+
+// Bytes per element of a list of the given type
+static inline int type_width(int t)
+{
+    switch (t)
+    {
+        case (KB): case (KG): case (KC):                return 1;
+        case (KH):                                      return 2;
+        case (KJ): case (KF): case (KP): case (KN):
+        case (KZ):                                      return 8;
+        case (UU):                                      return 16;
+        case (KS):                                      return sizeof(S);
+        case (0):                                       return sizeof(K);
+        default:                                        return 4;
+    }
+}
+
+// The generic null, ::
+static K identity()
+{
+    K x = ka(101);
+    x->g = 0;
+    return x;
+}
+
+// Splits a table or keyed table into the names and columns of its keys
+// and values, as serialise_keyed_table does. Unkeyed tables have no keys.
+static bool table_parts(K x, K& kkeys, K& kvalues, K& vkeys, K& vvalues)
+{
+    kkeys = kvalues = 0;
+
+    if (x->t == XT)
+    {
+        vkeys = kK(x->k)[0];
+        vvalues = kK(x->k)[1];
+        return true;
+    }
+    if (x->t == XD && kK(x)[0]->t == XT && kK(x)[1]->t == XT)
+    {
+        kkeys = kK(kK(x)[0]->k)[0];
+        kvalues = kK(kK(x)[0]->k)[1];
+        vkeys = kK(kK(x)[1]->k)[0];
+        vvalues = kK(kK(x)[1]->k)[1];
+        return true;
+    }
+    return false;
+}
+
+/*
+    Row fragment cache
+
+    tojsoncached[handle; t; dirty] serialises a table or keyed table like
+    tojson, but keeps the JSON of each row under the handle (a symbol) and
+    only re-encodes rows which changed since the previous call. Changes are
+    found by comparing the columns against copies kept from the previous
+    call, or are given as a list of row indices in dirty (:: to compare).
+    jsoncachefree[handle] drops a cache, or every cache given `.
+*/
+
+// Whether two q objects hold the same value
+static bool k_equal(K a, K b)
+{
+    if (a == b) return true;
+    if (a->t != b->t) return false;
+
+    if (a->t < 0)
+    {
+        if (a->t == -UU) return memcmp(kU(a), kU(b), sizeof(U)) == 0;
+        return memcmp(&a->g, &b->g, type_width(-a->t)) == 0;
+    }
+    if (a->t == XT) return k_equal(a->k, b->k);
+    if (a->t == XD) return k_equal(kK(a)[0], kK(b)[0]) && k_equal(kK(a)[1], kK(b)[1]);
+    if (a->t > 76 || a->n != b->n) return false;
+
+    if (a->t == 0)
+    {
+        for (J i = 0; i < a->n; i++)
+        {
+            if (! k_equal(kK(a)[i], kK(b)[i])) return false;
+        }
+        return true;
+    }
+    return memcmp(kG(a), kG(b), a->n * type_width(a->t)) == 0;
+}
+
+struct RowCache
+{
+    RowCache() : compared(false) {}
+    ~RowCache() { reset(); }
+
+    void reset()
+    {
+        for (size_t j = 0; j < lists.size(); j++)
+        {
+            for (size_t i = 0; i < lists[j].size(); i++) r0(lists[j][i]);
+        }
+        names.clear();
+        types.clear();
+        rows.clear();
+        fixed.clear();
+        lists.clear();
+        compared = false;
+    }
+
+    std::vector<S> names;                   // the columns the cache was built for
+    std::vector<int> types;
+    std::vector<std::string> rows;          // serialised rows
+    std::vector<std::string> fixed;         // previous data of each fixed-width column
+    std::vector<std::vector<K> > lists;     // previous items of each general list column
+    bool compared;                          // whether the previous data is current
+
+private:
+    RowCache(const RowCache&);
+    RowCache& operator=(const RowCache&);
+};
+
+static std::unordered_map<S, RowCache> row_caches;
+
+// Marks the rows of a column which differ from the cached copy, and brings
+// the copy up to date.
+static void compare_column(K col, std::string& fixed, std::vector<K>& list, std::vector<char>& dirty)
+{
+    const J rows = col->n;
+
+    if (col->t == 0)
+    {
+        const J common = std::min<J>(list.size(), rows);
+        for (J i = 0; i < common; i++)
+        {
+            if (! k_equal(list[i], kK(col)[i]))
+            {
+                dirty[i] = 1;
+                r0(list[i]);
+                list[i] = r1(kK(col)[i]);
+            }
+        }
+        for (J i = rows; i < (J)list.size(); i++) r0(list[i]);
+        list.resize(rows);
+        for (J i = common; i < rows; i++) list[i] = r1(kK(col)[i]);
+        return;
+    }
+
+    const int w = type_width(col->t);
+    const char* data = (const char*)kG(col);
+    const J common = std::min<J>(fixed.size() / w, rows);
+
+    if (memcmp(fixed.data(), data, common * w) == 0 && common == rows && (J)fixed.size() == rows * w) return;
+
+    for (J i = 0; i < common; i++)
+    {
+        if (memcmp(fixed.data() + i * w, data + i * w, w) != 0) dirty[i] = 1;
+    }
+    fixed.assign(data, rows * w);
+}
+
+extern "C" K tojsoncached(K handle, K x, K dirty)
+{
+    if (handle->t != -KS) return krr((S)"type");
+    if (dirty->t != 101 && dirty->t != KJ && dirty->t != KI) return krr((S)"type");
+
+    K kkeys, kvalues, vkeys, vvalues;
+    if (! table_parts(x, kkeys, kvalues, vkeys, vvalues)) return krr((S)"type");
+
+    std::vector<K> cols;
+    std::vector<S> names;
+    std::vector<int> types;
+    for (J j = 0; kkeys && j < kkeys->n; j++)
+    {
+        cols.push_back(kK(kvalues)[j]);
+        names.push_back(kS(kkeys)[j]);
+    }
+    for (J j = 0; j < vkeys->n; j++)
+    {
+        cols.push_back(kK(vvalues)[j]);
+        names.push_back(kS(vkeys)[j]);
+    }
+    for (size_t j = 0; j < cols.size(); j++) types.push_back(cols[j]->t);
+
+    const J rows = cols.empty() ? 0 : cols[0]->n;
+
+    RowCache& cache = row_caches[handle->s];
+    if (cache.names != names || cache.types != types)
+    {
+        cache.reset();
+        cache.names = names;
+        cache.types = types;
+        cache.fixed.resize(cols.size());
+        cache.lists.resize(cols.size());
+    }
+
+    // Rows without a cached fragment always need encoding
+    const J cached = cache.rows.size();
+    std::vector<char> changed(rows, 0);
+    for (J i = cached; i < rows; i++) changed[i] = 1;
+    cache.rows.resize(rows);
+
+    if (dirty->t != 101)
+    {
+        for (J k = 0; k < dirty->n; k++)
+        {
+            const J i = dirty->t == KJ ? kJ(dirty)[k] : kI(dirty)[k];
+            if (i >= 0 && i < rows) changed[i] = 1;
+        }
+        cache.compared = false;
+    }
+    else
+    {
+        if (! cache.compared)
+        {
+            std::fill(changed.begin(), changed.end(), 1);
+            for (size_t j = 0; j < cols.size(); j++)
+            {
+                cache.fixed[j].clear();
+                for (size_t i = 0; i < cache.lists[j].size(); i++) r0(cache.lists[j][i]);
+                cache.lists[j].clear();
+            }
+        }
+        for (size_t j = 0; j < cols.size(); j++)
+        {
+            compare_column(cols[j], cache.fixed[j], cache.lists[j], changed);
+        }
+        cache.compared = true;
+    }
+
+    StringBuffer buffer;
+    JsonWriter<StringBuffer> writer(buffer);
+    const TablePlan<JsonWriter<StringBuffer> > plan(kkeys, kvalues, vkeys, vvalues);
+    size_t total = rows > 0 ? rows + 1 : 2;
+
+    for (J i = 0; i < rows; i++)
+    {
+        if (changed[i])
+        {
+            buffer.Clear();
+            writer.Reset(buffer);
+            plan.row(writer, i);
+            cache.rows[i].assign(buffer.GetString(), buffer.GetSize());
+        }
+        total += cache.rows[i].size();
+    }
+
+    K ser = ktn(KC, total);
+    char* p = (char*)kC(ser);
+    *p++ = '[';
+    for (J i = 0; i < rows; i++)
+    {
+        if (i > 0) *p++ = ',';
+        memcpy(p, cache.rows[i].data(), cache.rows[i].size());
+        p += cache.rows[i].size();
+    }
+    *p++ = ']';
+
+    return ser;
+}
+
+extern "C" K jsoncachefree(K handle)
+{
+    if (handle->t != -KS) return krr((S)"type");
+
+    if (handle->s[0] == '\0') row_caches.clear();
+    else row_caches.erase(handle->s);
+
+    return identity();
+}
+
+/*
+    Table diffs
+
+    jsondiff[old; new] compares two snapshots of a table or keyed table and
+    returns an RFC 6902 JSON Patch which turns tojson old into tojson new.
+    Rows of keyed tables are matched by key, and those of unkeyed tables by
+    position. Only the changed fields of changed rows appear in the patch,
+    and columns which are unchanged as a whole are skipped with a memcmp.
+*/
+
+// Whether cell i of list a holds the same value as cell j of list b
+static bool cells_equal(K a, J i, K b, J j)
+{
+    if (a->t != b->t) return false;
+    if (a->t == 0) return k_equal(kK(a)[i], kK(b)[j]);
+
+    const int w = type_width(a->t);
+    return memcmp(kG(a) + i * w, kG(b) + j * w, w) == 0;
+}
+
+// The bytes identifying the key of a row, for matching rows between tables
+static std::string row_key(K kvalues, J i)
+{
+    std::string key;
+    for (J j = 0; j < kvalues->n; j++)
+    {
+        const K col = kK(kvalues)[j];
+        if (col->t == 0)
+        {
+            StringBuffer buffer;
+            JsonWriter<StringBuffer> writer(buffer);
+            serialise_atom(writer, col, i);
+            const J len = buffer.GetSize();
+            key.append((const char*)&len, sizeof(len));
+            key.append(buffer.GetString(), len);
+        }
+        else
+        {
+            const int w = type_width(col->t);
+            key.append((const char*)kG(col) + i * w, w);
+        }
+    }
+    return key;
+}
+
+// A JSON Pointer (RFC 6901) to a row, or to a field of it
+static std::string patch_path(J row, S col = 0)
+{
+    char buff[24];
+    snprintf(buff, sizeof(buff), "/%lld", row);
+    std::string path(buff);
+    if (col)
+    {
+        path += '/';
+        for (const char* c = col; *c; c++)
+        {
+            if (*c == '~') path += "~0";
+            else if (*c == '/') path += "~1";
+            else path += *c;
+        }
+    }
+    return path;
+}
+
+template<typename Writer>
+void patch_op(Writer& w, const char* op, const std::string& path)
+{
+    w.StartObject();
+    w.String("op");
+    w.String(op);
+    w.String("path");
+    w.String(path.data(), path.size());
+}
+
+// Replaces the fields of a row of new which differ from a row of old
+template<typename Writer>
+void patch_row(Writer& w, K oldcols, J orow, K vkeys, K newcols, J nrow)
+{
+    for (J j = 0; j < vkeys->n; j++)
+    {
+        if (cells_equal(kK(oldcols)[j], orow, kK(newcols)[j], nrow)) continue;
+
+        patch_op(w, "replace", patch_path(nrow, kS(vkeys)[j]));
+        w.String("value");
+        serialise_atom(w, kK(newcols)[j], nrow);
+        w.EndObject();
+    }
+}
+
+template<typename Writer>
+void patch_add(Writer& w, const std::string& path, K kkeys, K kvalues, K vkeys, K vvalues, J i)
+{
+    patch_op(w, "add", path);
+    w.String("value");
+    serialise_row(w, kkeys, kvalues, vkeys, vvalues, i);
+    w.EndObject();
+}
+
+// Whether two lists of names are the same
+static bool same_names(K a, K b)
+{
+    if (! a || ! b) return a == b;
+    return a->n == b->n && memcmp(kS(a), kS(b), a->n * sizeof(S)) == 0;
+}
+
+// Patches an unkeyed table, or a keyed table whose keys have not moved
+template<typename Writer>
+void diff_positional(Writer& w, K ovalues, J orows, K vkeys, K nvalues, J nrows, K nkkeys, K nkvalues)
+{
+    const J common = std::min(orows, nrows);
+
+    // Rows with a field in a changed column
+    std::vector<char> changed(common, 0);
+    for (J j = 0; j < vkeys->n; j++)
+    {
+        const K a = kK(ovalues)[j];
+        const K b = kK(nvalues)[j];
+        if (a->t == b->t && a->t > 0 && memcmp(kG(a), kG(b), common * type_width(a->t)) == 0) continue;
+
+        for (J i = 0; i < common; i++)
+        {
+            if (! changed[i] && ! cells_equal(a, i, b, i)) changed[i] = 1;
+        }
+    }
+
+    for (J i = 0; i < common; i++)
+    {
+        if (changed[i]) patch_row(w, ovalues, i, vkeys, nvalues, i);
+    }
+    for (J i = orows - 1; i >= nrows; i--)
+    {
+        patch_op(w, "remove", patch_path(i));
+        w.EndObject();
+    }
+    for (J i = common; i < nrows; i++)
+    {
+        patch_add(w, "/-", nkkeys, nkvalues, vkeys, nvalues, i);
+    }
+}
+
+// Patches a keyed table by matching rows on their keys. Returns false when
+// the rows kept from old are in a different order in new, which a patch
+// of adds and removes cannot express.
+template<typename Writer>
+bool diff_keyed(Writer& w, K okvalues, K ovalues, J orows, K kkeys, K nkvalues, K vkeys, K nvalues, J nrows)
+{
+    std::unordered_map<std::string, J> olds, news;
+    for (J i = 0; i < orows; i++) olds[row_key(okvalues, i)] = i;
+
+    std::vector<J> matched(nrows, -1);
+    J last = -1;
+    for (J i = 0; i < nrows; i++)
+    {
+        const std::string key = row_key(nkvalues, i);
+        news[key] = i;
+
+        std::unordered_map<std::string, J>::const_iterator it = olds.find(key);
+        if (it == olds.end()) continue;
+        if (it->second < last) return false;
+        matched[i] = last = it->second;
+    }
+
+    for (J i = orows - 1; i >= 0; i--)
+    {
+        if (news.count(row_key(okvalues, i))) continue;
+        patch_op(w, "remove", patch_path(i));
+        w.EndObject();
+    }
+    for (J i = 0; i < nrows; i++)
+    {
+        if (matched[i] < 0) patch_add(w, patch_path(i), kkeys, nkvalues, vkeys, nvalues, i);
+        else patch_row(w, ovalues, matched[i], vkeys, nvalues, i);
+    }
+    return true;
+}
+
+extern "C" K jsondiff(K old, K x)
+{
+    K okkeys, okvalues, ovkeys, ovalues;
+    K kkeys, kvalues, vkeys, vvalues;
+    if (! table_parts(old, okkeys, okvalues, ovkeys, ovalues)) return krr((S)"type");
+    if (! table_parts(x, kkeys, kvalues, vkeys, vvalues)) return krr((S)"type");
+
+    const J orows = ovkeys->n ? kK(ovalues)[0]->n : okkeys ? kK(okvalues)[0]->n : 0;
+    const J nrows = vkeys->n ? kK(vvalues)[0]->n : kkeys ? kK(kvalues)[0]->n : 0;
+
+    StringBuffer buffer;
+    JsonWriter<StringBuffer> writer(buffer);
+    writer.StartArray();
+
+    bool patched = same_names(okkeys, kkeys) && same_names(ovkeys, vkeys);
+    if (patched)
+    {
+        // Keyed tables whose keys are unchanged are diffed by position
+        bool moved = kkeys && orows != nrows;
+        for (J j = 0; kkeys && ! moved && j < kkeys->n; j++)
+        {
+            const K a = kK(okvalues)[j];
+            const K b = kK(kvalues)[j];
+            for (J i = 0; i < nrows && ! moved; i++) moved = ! cells_equal(a, i, b, i);
+        }
+
+        if (moved) patched = diff_keyed(writer, okvalues, ovalues, orows, kkeys, kvalues, vkeys, vvalues, nrows);
+        else diff_positional(writer, ovalues, orows, vkeys, vvalues, nrows, kkeys, kvalues);
+    }
+
+    if (! patched)
+    {
+        // Replace the whole document
+        buffer.Clear();
+        writer.Reset(buffer);
+        writer.StartArray();
+        patch_op(writer, "replace", "");
+        writer.String("value");
+        serialise_atom(writer, x);
+        writer.EndObject();
+    }
+
+    writer.EndArray();
+    return kpn((char*)buffer.GetString(), buffer.GetLength());
+}
+
+/*
+    Views
+
+    tojsonview[t; cols; rows] serialises some of the columns and rows of a
+    table or keyed table, as tojson would serialise the same select, but
+    straight from the table's own columns instead of a copy. cols names
+    key or value columns, in the order to write them, or is :: for all of
+    them. rows is a vector of row indices (eg: from where or iasc), a range
+    as `first`count!(first; count), or :: for all of them.
+*/
+
+// The column of a table called name, or 0
+static K find_column(K names, K columns, S name)
+{
+    for (J j = 0; names && j < names->n; j++)
+    {
+        if (kS(names)[j] == name) return kK(columns)[j];
+    }
+    return 0;
+}
+
+extern "C" K tojsonview(K x, K cols, K rows)
+{
+    K kkeys, kvalues, vkeys, vvalues;
+    if (! table_parts(x, kkeys, kvalues, vkeys, vvalues)) return krr((S)"type");
+    const J n = vkeys->n ? kK(vvalues)[0]->n : kkeys ? kK(kvalues)[0]->n : 0;
+
+    std::vector<std::pair<S, K> > order;
+    if (cols->t == 101)
+    {
+        for (J j = 0; kkeys && j < kkeys->n; j++) order.push_back(std::make_pair(kS(kkeys)[j], kK(kvalues)[j]));
+        for (J j = 0; j < vkeys->n; j++) order.push_back(std::make_pair(kS(vkeys)[j], kK(vvalues)[j]));
+    }
+    else if (cols->t == KS || cols->t == -KS)
+    {
+        const J count = cols->t == KS ? cols->n : 1;
+        for (J j = 0; j < count; j++)
+        {
+            const S name = cols->t == KS ? kS(cols)[j] : cols->s;
+            K values = find_column(kkeys, kvalues, name);
+            if (! values) values = find_column(vkeys, vvalues, name);
+            if (! values) return krr(name);
+            order.push_back(std::make_pair(name, values));
+        }
+    }
+    else
+    {
+        return krr((S)"type");
+    }
+
+    // The rows, as indices or a range
+    const K index = rows->t == KJ || rows->t == KI ? rows : 0;
+    J first = 0;
+    J last = n;
+    if (index)
+    {
+        for (J i = 0; i < index->n; i++)
+        {
+            const J r = index->t == KJ ? kJ(index)[i] : kI(index)[i];
+            if (r < 0 || r >= n) return krr((S)"index");
+        }
+    }
+    else if (rows->t == XD)
+    {
+        const K names = kK(rows)[0];
+        const K values = kK(rows)[1];
+        if (names->t != KS || (values->t != KJ && values->t != KI)) return krr((S)"type");
+        J count = n;
+        for (J i = 0; i < names->n; i++)
+        {
+            const J v = values->t == KJ ? kJ(values)[i] : kI(values)[i];
+            if (! strcmp(kS(names)[i], "first")) first = v;
+            else if (! strcmp(kS(names)[i], "count")) count = v;
+            else return krr(kS(names)[i]);
+        }
+        if (first < 0 || count < 0) return krr((S)"domain");
+        first = std::min(first, n);
+        last = first + std::min(count, n - first);
+    }
+    else if (rows->t != 101)
+    {
+        return krr((S)"type");
+    }
+
+    typedef JsonWriter<StringBuffer> ViewWriter;
+    StringBuffer buffer;
+    ViewWriter writer(buffer);
+    const TablePlan<ViewWriter> plan(order);
+
+    writer.StartArray();
+    if (index)
+    {
+        for (J i = 0; i < index->n; i++)
+        {
+            plan.row(writer, index->t == KJ ? kJ(index)[i] : kI(index)[i]);
+        }
+    }
+    else
+    {
+        for (J i = first; i < last; i++)
+        {
+            plan.row(writer, i);
+        }
+    }
+    writer.EndArray();
+
+    return kpn((char*)buffer.GetString(), buffer.GetLength());
+}
+
+/*
+    Websocket frames
+
+    tojsonws[options; x] serialises x as the payload of an RFC 6455 text
+    message, returning the bytes of its frames ready to be written to the
+    socket as they are. Room for the header is kept at the front of the
+    buffer, so a single frame is filled in once the length is known with
+    no further copy of the payload. The frame option splits the message
+    into frames of at most that many payload bytes, and deflate compresses
+    it as per RFC 7692 (permessage-deflate), with no context takeover.
+*/
+
+static const size_t ws_max_header = 10;
+
+// Bytes of the header of a server frame (unmasked) for a payload of len bytes
+static inline size_t ws_header_size(size_t len)
+{
+    return len < 126 ? 2 : len < 65536 ? 4 : 10;
+}
+
+// Writes a frame header at p, returning the end of it
+static char* ws_header(char* p, size_t len, int opcode, bool fin, bool rsv1)
+{
+    *p++ = (char)((fin ? 0x80 : 0) | (rsv1 ? 0x40 : 0) | opcode);
+    if (len < 126)
+    {
+        *p++ = (char)len;
+    }
+    else if (len < 65536)
+    {
+        *p++ = 126;
+        *p++ = (char)(len >> 8);
+        *p++ = (char)len;
+    }
+    else
+    {
+        *p++ = 127;
+        for (int b = 56; b >= 0; b -= 8) *p++ = (char)((unsigned long long)len >> b);
+    }
+    return p;
+}
+
+// Raw deflate of a whole message, without the 00 00 ff ff which ends the
+// final sync flush (RFC 7692 7.2.1)
+static bool ws_deflate(const char* in, size_t len, int level, std::string& out)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+
+    out.resize(deflateBound(&zs, len) + 16);
+    zs.next_in = (Bytef*)in;
+
+    // zlib counts in uInt, so the input goes in (and the output comes out)
+    // at most UINT_MAX bytes at a time
+    size_t left = len;
+    size_t n = 0;
+    int rc;
+    for (;;)
+    {
+        if (zs.avail_in == 0 && left)
+        {
+            zs.avail_in = (uInt)std::min(left, (size_t)UINT_MAX);
+            left -= zs.avail_in;
+        }
+        if (n == out.size()) out.resize(out.size() * 2);
+        const uInt room = (uInt)std::min(out.size() - n, (size_t)UINT_MAX);
+        zs.next_out = (Bytef*)&out[n];
+        zs.avail_out = room;
+
+        const int flush = left ? Z_NO_FLUSH : Z_SYNC_FLUSH;
+        rc = deflate(&zs, flush);
+        n += room - zs.avail_out;
+
+        // Z_BUF_ERROR only means there was nothing to do: the flush before
+        // filled the output exactly
+        if (rc == Z_BUF_ERROR && flush == Z_SYNC_FLUSH && zs.avail_in == 0 && zs.avail_out != 0) rc = Z_OK;
+        if (rc != Z_OK || (flush == Z_SYNC_FLUSH && zs.avail_out != 0)) break;
+    }
+
+    deflateEnd(&zs);
+    if (rc != Z_OK || n < 4) return false;
+
+    out.resize(n - 4);
+    return true;
+}
+
+extern "C" K tojsonws(K options, K x)
+{
+    Options opts;
+    const S bad = read_options(options, opts);
+    if (bad) return krr(bad);
+
+    StringBuffer buffer;
+    buffer.Push(ws_max_header);
+    JsonWriter<StringBuffer> writer(buffer, opts);
+
+    serialise_atom(writer, x);
+
+    const K error = budget_error(writer);
+    if (error) return error;
+
+    const char* payload = buffer.GetString() + ws_max_header;
+    size_t len = buffer.GetSize() - ws_max_header;
+
+    std::string deflated;
+    if (opts.deflate)
+    {
+        if (! ws_deflate(payload, len, opts.level, deflated)) return krr((S)"deflate");
+        payload = deflated.data();
+        len = deflated.size();
+    }
+
+    const size_t frame = opts.frame > 0 && (size_t)opts.frame < len ? (size_t)opts.frame : len;
+
+    if (frame == len && ! opts.deflate)
+    {
+        // Fill in the reserved space in front of the payload
+        char* start = (char*)payload - ws_header_size(len);
+        ws_header(start, len, 1, true, false);
+
+        K r = ktn(KG, payload + len - start);
+        memcpy(kG(r), start, r->n);
+        return budget_result(writer, r);
+    }
+
+    // Text frame then continuations, with RSV1 on the first for deflate
+    const size_t frames = len == 0 ? 1 : (len + frame - 1) / frame;
+    size_t total = len;
+    for (size_t f = 0; f < frames; f++)
+    {
+        total += ws_header_size(std::min(frame, len - f * frame));
+    }
+
+    K r = ktn(KG, total);
+    char* p = (char*)kG(r);
+    for (size_t f = 0; f < frames; f++)
+    {
+        const size_t n = std::min(frame, len - f * frame);
+        p = ws_header(p, n, f == 0 ? 1 : 0, f == frames - 1, f == 0 && opts.deflate);
+        memcpy(p, payload + f * frame, n);
+        p += n;
+    }
+    return budget_result(writer, r);
+}
+
+/*
+    Gzip output
+
+    tojsongz[options; x] serialises x straight into a gzip member, with the
+    level option as the compression level. The writer's output is handed to
+    zlib a block at a time, so only the compressed document is ever held.
+*/
+
+static const size_t gzip_block = 1 << 16;
+
+// A RapidJSON output stream deflating into a gzip member (cf. FileWriteStream)
+class GzipWriteStream
+{
+public:
+    typedef char Ch;
+
+    GzipWriteStream(int level) : buffer_(gzip_block), current_(&buffer_[0]), ok_(true)
+    {
+        memset(&zs_, 0, sizeof(zs_));
+        ok_ = deflateInit2(&zs_, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        open_ = ok_;
+    }
+
+    ~GzipWriteStream()
+    {
+        if (open_) deflateEnd(&zs_);
+    }
+
+    void Put(char c)
+    {
+        if (current_ == &buffer_[0] + gzip_block) Compress(Z_NO_FLUSH);
+        *current_++ = c;
+    }
+
+    // The Writer flushes after each document, which is left to Finish
+    void Flush() {}
+
+    // Compresses what is left and ends the member
+    bool Finish()
+    {
+        Compress(Z_FINISH);
+        return ok_;
+    }
+
+    // Bytes written, before compression
+    size_t GetSize() const { return zs_.total_in + (current_ - &buffer_[0]); }
+
+    const char* GetOutput() const { return out_.data(); }
+    size_t GetOutputSize() const { return zs_.total_out; }
+
+private:
+    void Compress(int flush)
+    {
+        zs_.next_in = (Bytef*)&buffer_[0];
+        zs_.avail_in = (uInt)(current_ - &buffer_[0]);
+        current_ = &buffer_[0];
+
+        while (ok_)
+        {
+            if (out_.size() - zs_.total_out < gzip_block / 4) out_.resize(std::max(out_.size() * 2, gzip_block));
+            // zlib counts in uInt, so offer at most UINT_MAX bytes of room at a time
+            zs_.next_out = (Bytef*)&out_[zs_.total_out];
+            zs_.avail_out = (uInt)std::min(out_.size() - zs_.total_out, (size_t)UINT_MAX);
+
+            const int rc = deflate(&zs_, flush);
+            if (rc == Z_STREAM_END) break;
+            if (rc != Z_OK && rc != Z_BUF_ERROR) ok_ = false;
+            else if (flush != Z_FINISH && zs_.avail_in == 0 && zs_.avail_out != 0) break;
+        }
+    }
+
+    std::vector<char> buffer_;
+    char* current_;
+    std::string out_;
+    z_stream zs_;
+    bool ok_;
+    bool open_;
+};
+
+extern "C" K tojsongz(K options, K x)
+{
+    Options opts;
+    const S bad = read_options(options, opts);
+    if (bad) return krr(bad);
+
+    GzipWriteStream stream(opts.level);
+    JsonWriter<GzipWriteStream> writer(stream, opts);
+
+    serialise_atom(writer, x);
+
+    const K error = budget_error(writer);
+    if (error) return error;
+
+    if (! stream.Finish()) return krr((S)"gzip");
+
+    K r = ktn(KG, stream.GetOutputSize());
+    memcpy(kG(r), stream.GetOutput(), r->n);
+    return budget_result(writer, r);
+}
+
+/*
+    Content hash
+
+    tojsonhash[options; x] returns the JSON of x along with a 64-bit hash of
+    it (XXH64), for use as an ETag. With the canonical option, equal
+    objects give the same JSON (and hash) whatever the order of their
+    dictionary keys and table columns.
+*/
+
+// XXH64 (https://github.com/Cyan4973/xxHash), fed any number of blocks
+class Xxh64
+{
+public:
+    Xxh64(uint64_t seed = 0) : seed(seed), total(0), buffered(0)
+    {
+        acc[0] = seed + p1 + p2;
+        acc[1] = seed + p2;
+        acc[2] = seed;
+        acc[3] = seed - p1;
+    }
+
+    void update(const char* s, size_t n)
+    {
+        total += n;
+        if (buffered + n < 32)
+        {
+            memcpy(buffer + buffered, s, n);
+            buffered += n;
+            return;
+        }
+
+        if (buffered)
+        {
+            const size_t fill = 32 - buffered;
+            memcpy(buffer + buffered, s, fill);
+            stripe(buffer);
+            s += fill;
+            n -= fill;
+            buffered = 0;
+        }
+        for (; n >= 32; s += 32, n -= 32) stripe(s);
+
+        memcpy(buffer, s, n);
+        buffered = n;
+    }
+
+    uint64_t digest() const
+    {
+        uint64_t h;
+        if (total >= 32)
+        {
+            h = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18);
+            for (int i = 0; i < 4; i++) h = (h ^ round(0, acc[i])) * p1 + p4;
+        }
+        else
+        {
+            h = seed + p5;
+        }
+        h += total;
+
+        const char* s = buffer;
+        const char* end = buffer + buffered;
+        for (; s + 8 <= end; s += 8) h = rotl(h ^ round(0, read64(s)), 27) * p1 + p4;
+        if (s + 4 <= end)
+        {
+            h = rotl(h ^ (read32(s) * p1), 23) * p2 + p3;
+            s += 4;
+        }
+        for (; s < end; s++) h = rotl(h ^ ((unsigned char)*s * p5), 11) * p1;
+
+        h ^= h >> 33;
+        h *= p2;
+        h ^= h >> 29;
+        h *= p3;
+        h ^= h >> 32;
+        return h;
+    }
+
+private:
+    static const uint64_t p1 = 11400714785074694791ULL;
+    static const uint64_t p2 = 14029467366897019727ULL;
+    static const uint64_t p3 = 1609587929392839161ULL;
+    static const uint64_t p4 = 9650029242287828579ULL;
+    static const uint64_t p5 = 2870177450012600261ULL;
+
+    static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+    static uint64_t round(uint64_t a, uint64_t lane) { return rotl(a + lane * p2, 31) * p1; }
+    static uint64_t read64(const char* s) { uint64_t v; memcpy(&v, s, 8); return v; }
+    static uint64_t read32(const char* s) { uint32_t v; memcpy(&v, s, 4); return v; }
+
+    void stripe(const char* s)
+    {
+        for (int i = 0; i < 4; i++) acc[i] = round(acc[i], read64(s + 8 * i));
+    }
+
+    uint64_t seed;
+    uint64_t acc[4];
+    uint64_t total;
+    char buffer[32];
+    size_t buffered;
+};
+
+extern "C" K tojsonhash(K options, K x)
+{
+    Options opts;
+    const S bad = read_options(options, opts);
+    if (bad) return krr(bad);
+
+    StringBuffer buffer;
+    JsonWriter<StringBuffer> writer(buffer, opts);
+
+    serialise_atom(writer, x);
+
+    const K error = budget_error(writer);
+    if (error) return error;
+
+    Xxh64 hash;
+    hash.update(buffer.GetString(), buffer.GetSize());
+
+    return budget_result(writer, knk(2, kpn((char*)buffer.GetString(), buffer.GetLength()), kj((J)hash.digest())));
+}
+
+/*
+    Schema-driven parsing
+
+    fromjson[schema; text] parses an array of objects straight into typed
+    q columns. The schema names the columns and their q types, either as a
+    dictionary of names to type chars (eg: `sym`px`time!"sfp", with "C" for
+    a string column) or as an empty table. Fields which are not in the
+    schema are skipped without being built, and missing fields become nulls.
+    The Reader parses iteratively, so no depth of nesting in a skipped field
+    can overflow the stack.
+*/
+
+static const char* qtype_chars = " bg xhijefcspmdznuvt";
+
+// Days since 2000.01.01, see: http://howardhinnant.github.io/date_algorithms.html
+static inline int days_from_civil(int y, int m, int d)
+{
+    y -= m <= 2;
+    const int era = (y >= 0 ? y : y - 399) / 400;
+    const int yoe = y - era * 400;
+    const int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    const int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 730425;
+}
+
+static inline bool parse_digits(const char*& p, const char* end, int count, int& out)
+{
+    if (end - p < count) return false;
+    out = 0;
+    for (int i = 0; i < count; i++)
+    {
+        const unsigned d = (unsigned char)p[i] - '0';
+        if (d > 9) return false;
+        out = out * 10 + d;
+    }
+    p += count;
+    return true;
+}
+
+static inline bool parse_sep(const char*& p, const char* end, char c)
+{
+    if (p == end || *p != c) return false;
+    p++;
+    return true;
+}
+
+// YYYY-MM-DD (or q's YYYY.MM.DD), as days since 2000.01.01
+static bool parse_date(const char*& p, const char* end, int& days)
+{
+    int y, m, d;
+    if (! parse_digits(p, end, 4, y) || p == end || (*p != '-' && *p != '.')) return false;
+    const char sep = *p++;
+    if (! parse_digits(p, end, 2, m) || ! parse_sep(p, end, sep) || ! parse_digits(p, end, 2, d)) return false;
+    if (m < 1 || m > 12 || d < 1 || d > 31) return false;
+    days = days_from_civil(y, m, d);
+    return true;
+}
+
+// Whether the eight bytes at p are all digits, other than those under seps
+// (0xFF in the byte of each separator, bytes being in memory order)
+static inline bool eight_digits(const char* p, uint64_t seps = 0)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    v = (v & ~seps) | (0x3030303030303030ULL & seps);
+    return ((v & 0xF0F0F0F0F0F0F0F0ULL) | (((v + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) == 0x3333333333333333ULL;
+}
+
+// The value of eight digits at p, combined in pairs, fours and then eights
+// within one word (see: https://lemire.me/blog/2022/01/21/swar-explained-parsing-eight-digits/)
+static inline uint32_t eight_digits_value(const char* p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    v -= 0x3030303030303030ULL;
+    v = v * 10 + (v >> 8);
+    v = ((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32)) + ((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32))) >> 32;
+    return (uint32_t)v;
+}
+
+static inline int two_digits_value(const char* p)
+{
+    return (p[0] - '0') * 10 + (p[1] - '0');
+}
+
+// The digits of a fraction of a second (beyond the ninth are dropped), as nanoseconds
+static bool parse_fraction(const char*& p, const char* end, J& frac)
+{
+    int digits = 0;
+    frac = 0;
+    if (end - p >= 8 && eight_digits(p))
+    {
+        frac = eight_digits_value(p);
+        p += 8;
+        digits = 8;
+    }
+    for (; p != end && (unsigned)(*p - '0') <= 9; p++, digits++)
+    {
+        if (digits < 9) frac = frac * 10 + (*p - '0');
+    }
+    if (digits == 0) return false;
+    for (; digits < 9; digits++) frac *= 10;
+    return true;
+}
+
+// hh:mm[:ss[.fffffffff]] (or a comma for the point), as nanoseconds since midnight
+static bool parse_time_of_day(const char*& p, const char* end, J& nanos)
+{
+    int h, m, s = 0;
+    if (! parse_digits(p, end, 2, h) || ! parse_sep(p, end, ':') || ! parse_digits(p, end, 2, m)) return false;
+    J frac = 0;
+    if (p != end && *p == ':')
+    {
+        p++;
+        if (! parse_digits(p, end, 2, s)) return false;
+        if (p != end && (*p == '.' || *p == ','))
+        {
+            p++;
+            if (! parse_fraction(p, end, frac)) return false;
+        }
+    }
+    if (m > 59 || s > 60) return false;
+    nanos = ((h * 60 + m) * 60 + s) * 1000000000LL + frac;
+    return true;
+}
+
+// Nothing, Z or an offset from UTC (+hh, +hhmm or +hh:mm), as nanoseconds
+// to take off a local time
+static bool parse_zone(const char*& p, const char* end, J& offset)
+{
+    offset = 0;
+    if (p == end) return true;
+    if (*p == 'Z' || *p == 'z')
+    {
+        p++;
+        return true;
+    }
+    if (*p != '+' && *p != '-') return false;
+
+    const J sign = *p++ == '-' ? -1 : 1;
+    int h, m = 0;
+    if (! parse_digits(p, end, 2, h)) return false;
+    if (p != end)
+    {
+        parse_sep(p, end, ':');
+        if (! parse_digits(p, end, 2, m)) return false;
+    }
+    if (h > 23 || m > 59) return false;
+    offset = sign * (h * 60 + m) * 60000000000LL;
+    return true;
+}
+
+// The layout timestamps are written in, 2024-05-01D12:34:56.123456789 (T
+// for D and a trailing Z allowed), without the branch per character of
+// the general parser. Other layouts fall back to it.
+static bool parse_timestamp_fixed(const char* s, size_t n, J& out)
+{
+    if (n != 29 && (n != 30 || (s[29] != 'Z' && s[29] != 'z'))) return false;
+
+    // YYYY-MM- DDThh:mm :ss.ffff ffffffff f
+    const bool digits = eight_digits(s, 0xFF0000FF00000000ULL)
+                      & eight_digits(s + 8, 0x0000FF0000FF0000ULL)
+                      & eight_digits(s + 16, 0x00000000FF0000FFULL)
+                      & eight_digits(s + 20)
+                      & ((unsigned)(s[28] - '0') <= 9);
+    const bool seps = (s[4] == '-' || s[4] == '.') & (s[7] == s[4])
+                    & (s[10] == 'D' || s[10] == 'T' || s[10] == 't' || s[10] == ' ')
+                    & (s[13] == ':') & (s[16] == ':') & (s[19] == '.' || s[19] == ',');
+    if (! (digits & seps)) return false;
+
+    const int y = two_digits_value(s) * 100 + two_digits_value(s + 2);
+    const int m = two_digits_value(s + 5);
+    const int d = two_digits_value(s + 8);
+    const int hh = two_digits_value(s + 11);
+    const int mm = two_digits_value(s + 14);
+    const int ss = two_digits_value(s + 17);
+    if (m < 1 || m > 12 || d < 1 || d > 31 || mm > 59 || ss > 60) return false;
+
+    const J frac = eight_digits_value(s + 20) * 10LL + (s[28] - '0');
+    out = days_from_civil(y, m, d) * 86400000000000LL + ((hh * 60 + mm) * 60 + ss) * 1000000000LL + frac;
+    return true;
+}
+
+// Parses the textual forms written by the serialiser back into the
+// underlying value of a temporal type (eg: nanoseconds for timestamps).
+// ISO 8601 variants are accepted too: T, t or a space between date and
+// time, a comma for the point, and Z or an offset on timestamps and
+// datetimes (which are then converted to UTC).
+static bool parse_temporal(int t, const char* s, size_t n, J& out)
+{
+    const char* p = s;
+    const char* end = s + n;
+    int days, y, m;
+    J nanos, offset;
+
+    if (t == KP && parse_timestamp_fixed(s, n, out)) return true;
+
+    switch (t)
+    {
+        case (KD):
+            if (! parse_date(p, end, days)) return false;
+            out = days;
+            break;
+
+        case (KM):
+            if (! parse_digits(p, end, 4, y) || p == end || (*p != '-' && *p != '.')) return false;
+            p++;
+            if (! parse_digits(p, end, 2, m) || m < 1 || m > 12) return false;
+            out = (y - 2000) * 12 + m - 1;
+            break;
+
+        case (KP):
+        case (KZ):
+            if (! parse_date(p, end, days)) return false;
+            nanos = 0;
+            if (p != end && (*p == 'D' || *p == 'T' || *p == 't' || *p == ' '))
+            {
+                p++;
+                if (! parse_time_of_day(p, end, nanos)) return false;
+            }
+            if (! parse_zone(p, end, offset)) return false;
+            out = days * 86400000000000LL + nanos - offset;
+            break;
+
+        case (KN):
+        {
+            const bool neg = p != end && *p == '-';
+            if (neg) p++;
+            J d = 0;
+            const char* q = p;
+            while (q != end && (unsigned)(*q - '0') <= 9) q++;
+            if (q != end && *q == 'D')
+            {
+                for (; p != q; p++) d = d * 10 + (*p - '0');
+                p++;
+            }
+            if (! parse_time_of_day(p, end, nanos)) return false;
+            out = d * 86400000000000LL + nanos;
+            if (neg) out = -out;
+            break;
+        }
+
+        case (KT):
+            if (! parse_time_of_day(p, end, nanos)) return false;
+            if (p != end && (*p == 'Z' || *p == 'z')) p++;
+            out = nanos / 1000000;
+            break;
+
+        case (KU):
+            if (! parse_time_of_day(p, end, nanos)) return false;
+            if (p != end && (*p == 'Z' || *p == 'z')) p++;
+            out = nanos / 60000000000LL;
+            break;
+
+        case (KV):
+            if (! parse_time_of_day(p, end, nanos)) return false;
+            if (p != end && (*p == 'Z' || *p == 'z')) p++;
+            out = nanos / 1000000000LL;
+            break;
+
+        default:
+            return false;
+    }
+
+    return p == end;
+}
+
+static bool parse_guid(const char* s, size_t n, U& guid)
+{
+    size_t j = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (s[i] == '-') continue;
+        const char c = s[i] | 0x20;
+        const int v = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+        if (v < 0 || j >= 32) return false;
+        guid.g[j / 2] = (j & 1) ? (guid.g[j / 2] | v) : (v << 4);
+        j++;
+    }
+    return j == 32;
+}
+
+struct ColumnSpec
+{
+    std::string name;
+    int type;   // q type of the column, 0 being a list of strings
+};
+
+// Appends straight onto a q vector
+struct SchemaColumn : ColumnSpec
+{
+    K vec;
+
+    SchemaColumn(const ColumnSpec& spec) : ColumnSpec(spec), vec(ktn(spec.type, 0)) {}
+
+    J count() const                             { return vec->n; }
+    void put(const void* v)                     { ja(&vec, (V*)v); }
+    void put_sym(const char* s, SizeType n)     { js(&vec, sn((S)s, n)); }
+    void put_string(const char* s, SizeType n)  { jk(&vec, kpn((S)s, n)); }
+
+    void pop()
+    {
+        vec->n--;
+        if (type == 0) r0(kK(vec)[vec->n]);
+    }
+};
+
+// Appends into plain buffers instead, so that it can be used away from the
+// main thread. Symbols are kept as codes into a local table of distinct
+// strings, to be interned once on the main thread.
+struct BufferColumn : ColumnSpec
+{
+    std::vector<char> data;
+    std::vector<std::string> strings;
+    std::unordered_map<std::string, I> codes;
+    J n;
+
+    BufferColumn(const ColumnSpec& spec) : ColumnSpec(spec), n(0) {}
+
+    J count() const { return n; }
+
+    void put(const void* v)
+    {
+        const char* p = (const char*)v;
+        data.insert(data.end(), p, p + type_width(type));
+        n++;
+    }
+
+    void put_sym(const char* s, SizeType len)
+    {
+        std::pair<std::unordered_map<std::string, I>::iterator, bool> it =
+            codes.insert(std::make_pair(std::string(s, len), (I)strings.size()));
+        if (it.second) strings.push_back(it.first->first);
+        const I code = it.first->second;
+        data.insert(data.end(), (const char*)&code, (const char*)&code + sizeof(code));
+        n++;
+    }
+
+    void put_string(const char* s, SizeType len)
+    {
+        strings.push_back(std::string(s, len));
+        n++;
+    }
+
+    void pop()
+    {
+        if (type == 0) strings.pop_back();
+        else data.resize(data.size() - (type == KS ? sizeof(I) : type_width(type)));
+        n--;
+    }
+};
+
+// A scalar JSON value, as reported by the Reader
+struct Scalar
+{
+    enum Kind { Null, Bool, Int, Double, String };
+
+    Kind kind;
+    J j;
+    F f;
+    const char* s;
+    SizeType n;
+};
+
+template<typename Column>
+class SchemaHandler : public BaseReaderHandler<UTF8<>, SchemaHandler<Column> >
+{
+public:
+    SchemaHandler(std::vector<Column>& cols)
+        : cols(cols), rows(0), single(false), depth(0), skip(0), col(-1), next(0)
+    {
+    }
+
+    bool Null()                 { Scalar v = { Scalar::Null };            return value(v); }
+    bool Bool(bool b)           { Scalar v = { Scalar::Bool, b };         return value(v); }
+    bool Int(int i)             { Scalar v = { Scalar::Int, i };          return value(v); }
+    bool Uint(unsigned u)       { Scalar v = { Scalar::Int, u };          return value(v); }
+    bool Int64(int64_t i)       { Scalar v = { Scalar::Int, i };          return value(v); }
+    bool Uint64(uint64_t u)     { Scalar v = { u > (uint64_t)wj ? Scalar::Double : Scalar::Int, (J)u, (F)u }; return value(v); }
+    bool Double(double d)       { Scalar v = { Scalar::Double, 0, d };    return value(v); }
+
+    bool String(const char* str, SizeType len, bool)
+    {
+        Scalar v = { Scalar::String, 0, 0, str, len };
+        return value(v);
+    }
+
+    bool Key(const char* str, SizeType len, bool)
+    {
+        if (skip) return true;
+
+        // Fields usually arrive in the same order on every row, so try the
+        // column after the previous one first.
+        const int ncols = cols.size();
+        for (int k = 0; k < ncols; k++)
+        {
+            const int c = (next + k) % ncols;
+            if (cols[c].name.size() == len && memcmp(cols[c].name.data(), str, len) == 0)
+            {
+                col = c;
+                next = c + 1;
+                return true;
+            }
+        }
+        col = -1;
+        return true;
+    }
+
+    bool StartObject()
+    {
+        if (skip) { skip++; return true; }
+
+        if (depth < 2)
+        {
+            single = depth == 0;
+            depth = 2;
+            return true;
+        }
+        if (col >= 0) return mismatch(cols[col]);
+        skip = 1;
+        return true;
+    }
+
+    bool EndObject(SizeType)
+    {
+        if (skip) { skip--; return true; }
+
+        end_row();
+        depth = single ? 0 : 1;
+        return true;
+    }
+
+    bool StartArray()
+    {
+        if (skip) { skip++; return true; }
+
+        if (depth == 0)
+        {
+            depth = 1;
+            return true;
+        }
+        if (depth == 1) return fail("expected an object");
+        if (col >= 0) return mismatch(cols[col]);
+        skip = 1;
+        return true;
+    }
+
+    bool EndArray(SizeType)
+    {
+        if (skip) { skip--; return true; }
+
+        depth = 0;
+        return true;
+    }
+
+    std::vector<Column>& cols;
+    J rows;
+    bool single;
+    std::string error;
+
+private:
+    bool fail(const char* msg)
+    {
+        error = msg;
+        return false;
+    }
+
+    bool mismatch(const Column& c)
+    {
+        error = "type: " + c.name;
+        return false;
+    }
+
+    bool value(const Scalar& v)
+    {
+        if (skip) return true;
+        if (depth != 2) return fail("expected an object");
+        if (col < 0) return true;
+
+        Column& c = cols[col];
+        col = -1;
+
+        // A repeated field replaces the earlier value on this row
+        if (c.count() > rows) c.pop();
+        return store(c, v) || mismatch(c);
+    }
+
+    // Rounds to the nearest long, failing for anything out of its range
+    // (including infinities), as converting those to J is undefined
+    static bool round_long(F f, J& out)
+    {
+        const F r = round(f);
+        if (! (fabs(r) < 9223372036854775808.0)) return false;
+        out = (J)r;
+        return true;
+    }
+
+    static bool to_long(const Scalar& v, J nullv, J& out)
+    {
+        switch (v.kind)
+        {
+            case (Scalar::Null):    out = nullv; return true;
+            case (Scalar::Bool):
+            case (Scalar::Int):     out = v.j; return true;
+            case (Scalar::Double):
+            {
+                if (std::isnan(v.f)) { out = nullv; return true; }
+                return round_long(v.f, out);
+            }
+            case (Scalar::String):
+            {
+                // Numbers are sometimes quoted to preserve their precision
+                std::string s(v.s, v.n);
+                char* end;
+                errno = 0;
+                out = strtoll(s.c_str(), &end, 10);
+                if (*end == '.')
+                {
+                    const F f = strtod(s.c_str(), &end);
+                    if (! round_long(f, out)) return false;
+                }
+                else if (errno == ERANGE)
+                {
+                    return false;
+                }
+                return v.n > 0 && *end == '\0';
+            }
+        }
+        return false;
+    }
+
+    static bool to_double(const Scalar& v, F& out)
+    {
+        switch (v.kind)
+        {
+            case (Scalar::Null):    out = nf; return true;
+            case (Scalar::Bool):
+            case (Scalar::Int):     out = v.j; return true;
+            case (Scalar::Double):  out = v.f; return true;
+            case (Scalar::String):
+            {
+                std::string s(v.s, v.n);
+                if (s == "Inf")  { out = wf;  return true; }
+                if (s == "-Inf") { out = -wf; return true; }
+                char* end;
+                out = strtod(s.c_str(), &end);
+                return v.n > 0 && *end == '\0';
+            }
+        }
+        return false;
+    }
+
+    static bool store(Column& c, const Scalar& v)
+    {
+        J j;
+        F f;
+
+        switch (c.type)
+        {
+            case (0):
+            {
+                if (v.kind != Scalar::String && v.kind != Scalar::Null) return false;
+                c.put_string(v.s, v.kind == Scalar::String ? v.n : 0);
+                return true;
+            }
+
+            case (KS):
+            {
+                if (v.kind != Scalar::String && v.kind != Scalar::Null) return false;
+                c.put_sym(v.kind == Scalar::String ? v.s : "", v.kind == Scalar::String ? v.n : 0);
+                return true;
+            }
+
+            case (KC):
+            {
+                if (v.kind != Scalar::String && v.kind != Scalar::Null) return false;
+                C ch = (v.kind == Scalar::String && v.n > 0) ? v.s[0] : ' ';
+                c.put(&ch);
+                return true;
+            }
+
+            case (KB):
+            case (KG):
+            {
+                if (! to_long(v, 0, j)) return false;
+                G g = (c.type == KB) ? (j != 0) : (G)j;
+                c.put(&g);
+                return true;
+            }
+
+            case (KH):
+            {
+                if (! to_long(v, nh, j)) return false;
+                H h = (H)j;
+                c.put(&h);
+                return true;
+            }
+
+            case (KI):
+            {
+                if (! to_long(v, ni, j)) return false;
+                I i = (I)j;
+                c.put(&i);
+                return true;
+            }
+
+            case (KJ):
+            {
+                if (! to_long(v, nj, j)) return false;
+                c.put(&j);
+                return true;
+            }
+
+            case (KE):
+            {
+                if (! to_double(v, f)) return false;
+                E e = (E)f;
+                c.put(&e);
+                return true;
+            }
+
+            case (KF):
+            {
+                if (! to_double(v, f)) return false;
+                c.put(&f);
+                return true;
+            }
+
+            case (UU):
+            {
+                U g = {{0}};
+                if (v.kind == Scalar::String && ! parse_guid(v.s, v.n, g)) return false;
+                if (v.kind != Scalar::String && v.kind != Scalar::Null) return false;
+                c.put(&g);
+                return true;
+            }
+
+            case (KP):
+            case (KN):
+            {
+                if (v.kind == Scalar::String) { if (! parse_temporal(c.type, v.s, v.n, j)) return false; }
+                else if (! to_long(v, nj, j)) return false;
+                c.put(&j);
+                return true;
+            }
+
+            case (KZ):
+            {
+                if (v.kind == Scalar::String)
+                {
+                    if (! parse_temporal(c.type, v.s, v.n, j)) return false;
+                    f = j / 8.64e13;
+                }
+                else if (! to_double(v, f)) return false;
+                c.put(&f);
+                return true;
+            }
+
+            case (KM):
+            case (KD):
+            case (KU):
+            case (KV):
+            case (KT):
+            {
+                if (v.kind == Scalar::String) { if (! parse_temporal(c.type, v.s, v.n, j)) return false; }
+                else if (! to_long(v, ni, j)) return false;
+                I i = (I)j;
+                c.put(&i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void end_row()
+    {
+        static const Scalar null = { Scalar::Null };
+
+        for (size_t c = 0; c < cols.size(); c++)
+        {
+            if (cols[c].count() == rows) store(cols[c], null);
+        }
+        rows++;
+        next = 0;
+    }
+
+    int depth;  // 0: top level, 1: in the array of rows, 2: in a row
+    int skip;   // depth within a skipped field value
+    int col;    // column of the current field, or -1 to skip it
+    int next;
+};
+
+static bool read_schema(K schema, std::vector<ColumnSpec>& cols)
+{
+    K names, types;
+
+    if (schema->t == XT)
+    {
+        names = kK(schema->k)[0];
+        types = kK(schema->k)[1];
+    }
+    else if (schema->t == XD)
+    {
+        names = kK(schema)[0];
+        types = kK(schema)[1];
+    }
+    else
+    {
+        return false;
+    }
+
+    if (names->t != KS || (types->t != KC && types->t != 0) || names->n != types->n) return false;
+
+    for (J i = 0; i < names->n; i++)
+    {
+        ColumnSpec c;
+        c.name = kS(names)[i];
+
+        if (types->t == KC)
+        {
+            const char t = kC(types)[i];
+            const char* p = t == 'C' ? qtype_chars : strchr(qtype_chars, t);
+            if (! p || t == ' ' || t == '\0') return false;
+            c.type = p - qtype_chars;
+        }
+        else
+        {
+            // An empty table, or a list of empty vectors
+            const K v = kK(types)[i];
+            if (v->t < 0 || v->t > KT || v->t == 3) return false;
+            c.type = v->t;
+        }
+        cols.push_back(c);
+    }
+    return true;
+}
+
+// The single row of a column, as an atom
+static K column_atom(const SchemaColumn& c)
+{
+    if (c.type == 0) return r1(kK(c.vec)[0]);
+    if (c.type == UU) return ku(kU(c.vec)[0]);
+
+    K x = ka(-c.type);
+    switch (c.type)
+    {
+        case (KB): case (KG): case (KC):    x->g = kG(c.vec)[0]; break;
+        case (KH):                          x->h = kH(c.vec)[0]; break;
+        case (KS):                          x->s = kS(c.vec)[0]; break;
+        case (KE):                          x->e = kE(c.vec)[0]; break;
+        case (KF): case (KZ):               x->f = kF(c.vec)[0]; break;
+        case (KJ): case (KP): case (KN):    x->j = kJ(c.vec)[0]; break;
+        default:                            x->i = kI(c.vec)[0]; break;
+    }
+    return x;
+}
+
+extern "C" K fromjson(K schema, K text)
+{
+    if (text->t != KC) return krr((S)"type");
+
+    std::vector<ColumnSpec> specs;
+    if (! read_schema(schema, specs)) return krr((S)"schema");
+
+    std::vector<SchemaColumn> cols(specs.begin(), specs.end());
+    SchemaHandler<SchemaColumn> handler(cols);
+    Reader reader;
+    MemoryStream ms((const char*)kC(text), text->n);
+    ParseResult ok = reader.Parse<kParseIterativeFlag>(ms, handler);
+
+    if (! ok)
+    {
+        for (size_t c = 0; c < cols.size(); c++) r0(cols[c].vec);
+        return krr(handler.error.empty() ? (S)GetParseError_En(ok.Code()) : ss((S)handler.error.c_str()));
+    }
+
+    K names = ktn(KS, cols.size());
+    K values = ktn(0, cols.size());
+    for (size_t c = 0; c < cols.size(); c++)
+    {
+        kS(names)[c] = ss((S)cols[c].name.c_str());
+        if (handler.single)
+        {
+            kK(values)[c] = column_atom(cols[c]);
+            r0(cols[c].vec);
+        }
+        else
+        {
+            kK(values)[c] = cols[c].vec;
+        }
+    }
+
+    return handler.single ? xD(names, values) : xT(xD(names, values));
+}
+
+/*
+    NDJSON file ingest
+
+    fromjsonlfile[path; schema] maps a file of newline-delimited objects and
+    parses it on every core. The file is split at newlines into one range per
+    thread, and each range is parsed into plain buffers (nothing on a worker
+    touches the interpreter). The buffers are then concatenated into q
+    vectors on the main thread. Lines are parsed iteratively, as worker
+    threads have even less stack to spare for deep nesting.
+*/
+
+struct ChunkParser
+{
+    ChunkParser(const std::vector<ColumnSpec>& specs, const char* begin, const char* end)
+        : cols(specs.begin(), specs.end()), rows(0), begin(begin), end(end), error_at(0)
+    {
+    }
+
+    void run()
+    {
+        SchemaHandler<BufferColumn> handler(cols);
+        Reader reader;
+
+        for (const char* line = begin; line < end; )
+        {
+            const char* eol = (const char*)memchr(line, '\n', end - line);
+            if (! eol) eol = end;
+
+            const char* p = line;
+            while (p < eol && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+
+            if (p < eol)
+            {
+                MemoryStream ms(p, eol - p);
+                ParseResult ok = reader.Parse<kParseIterativeFlag>(ms, handler);
+                if (! ok)
+                {
+                    error = handler.error.empty() ? GetParseError_En(ok.Code()) : handler.error;
+                    error_at = line;
+                    return;
+                }
+            }
+            line = eol + 1;
+        }
+        rows = handler.rows;
+    }
+
+    std::vector<BufferColumn> cols;
+    J rows;
+    const char* begin;
+    const char* end;
+    std::string error;
+    const char* error_at;
+};
+
+// Concatenates one column of every chunk into a q vector
+static K merge_column(std::vector<ChunkParser>& chunks, size_t c, int type, J rows)
+{
+    K x = ktn(type, rows);
+    J at = 0;
+
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+        BufferColumn& col = chunks[i].cols[c];
+
+        if (type == 0)
+        {
+            for (J r = 0; r < col.n; r++)
+            {
+                kK(x)[at + r] = kpn((S)col.strings[r].data(), col.strings[r].size());
+            }
+        }
+        else if (type == KS)
+        {
+            std::vector<S> syms(col.strings.size());
+            for (size_t k = 0; k < syms.size(); k++)
+            {
+                syms[k] = ss((S)col.strings[k].c_str());
+            }
+            const I* codes = (const I*)col.data.data();
+            for (J r = 0; r < col.n; r++)
+            {
+                kS(x)[at + r] = syms[codes[r]];
+            }
+        }
+        else if (col.n > 0)
+        {
+            memcpy(kG(x) + at * type_width(type), col.data.data(), col.data.size());
+        }
+
+        at += col.n;
+        std::vector<char>().swap(col.data);
+        std::vector<std::string>().swap(col.strings);
+    }
+    return x;
+}
+
+// The name of a file given as a file symbol (eg: `:/data/x) or a string
+static bool file_path(K path, std::string& file)
+{
+    if (path->t == -KS) file = path->s;
+    else if (path->t == KC) file.assign((const char*)kC(path), path->n);
+    else return false;
+
+    if (! file.empty() && file[0] == ':') file.erase(0, 1);
+    return true;
+}
+
+// A file mapped read-only into memory, unmapped when it goes out of scope
+class MappedFile
+{
+public:
+    MappedFile() : data(0), size(0) {}
+
+    ~MappedFile()
+    {
+        if (data) munmap((void*)data, size);
+    }
+
+    // Maps the file for reading from start to end, returning false (with
+    // errno set) if it cannot be. Empty files map to no data.
+    bool open(const std::string& file)
+    {
+        const int fd = ::open(file.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0;
+        if (ok && st.st_size > 0)
+        {
+            void* m = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ok = m != MAP_FAILED;
+            if (ok)
+            {
+                data = (const char*)m;
+                size = st.st_size;
+                madvise(m, size, MADV_SEQUENTIAL);
+            }
+        }
+        close(fd);
+        return ok;
+    }
+
+    const char* data;
+    size_t size;
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+};
+
+// Signals error along with where in the input it was found (eg: type: px
+// (line 3)). The text is kept in a static buffer rather than interned, so
+// that bad input cannot grow the symbol table one message at a time.
+static K located_error(const std::string& error, const char* where, J n)
+{
+    static char text[256];
+    snprintf(text, sizeof(text), "%s (%s %lld)", error.c_str(), where, n);
+    return krr(text);
+}
+
+extern "C" K fromjsonlfile(K path, K schema)
+{
+    std::string file;
+    if (! file_path(path, file)) return krr((S)"type");
+
+    std::vector<ColumnSpec> specs;
+    if (! read_schema(schema, specs)) return krr((S)"schema");
+
+    MappedFile mapped;
+    if (! mapped.open(file)) return orr(ss((S)file.c_str()));
+
+    const char* base = mapped.data;
+    const size_t size = mapped.size;
+
+    // One range per core, but no smaller than a megabyte, with every range
+    // after the first starting on a fresh line.
+    size_t nthreads = std::thread::hardware_concurrency();
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > size / (1 << 20) + 1) nthreads = size / (1 << 20) + 1;
+
+    // Nothing may throw into q, so running out of memory here is 'wsfull
+    std::vector<ChunkParser> chunks;
+    try
+    {
+        const char* start = base;
+        for (size_t i = 1; i <= nthreads; i++)
+        {
+            const char* stop = base + size;
+            if (i < nthreads)
+            {
+                const char* cut = base + size / nthreads * i;
+                if (cut < start) cut = start;
+                const char* eol = (const char*)memchr(cut, '\n', base + size - cut);
+                if (eol) stop = eol + 1;
+            }
+            chunks.push_back(ChunkParser(specs, start, stop));
+            start = stop;
+        }
+    }
+    catch (...)
+    {
+        return krr((S)"wsfull");
+    }
+
+    // Chunks no thread could be started for are parsed here, after the first
+    std::vector<std::thread> workers;
+    size_t started = 1;
+    try
+    {
+        workers.reserve(chunks.size() - 1);
+        for (; started < chunks.size(); started++)
+        {
+            workers.push_back(std::thread(&ChunkParser::run, &chunks[started]));
+        }
+    }
+    catch (...)
+    {
+    }
+    chunks[0].run();
+    for (size_t i = started; i < chunks.size(); i++)
+    {
+        chunks[i].run();
+    }
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+
+    K result = 0;
+    for (size_t i = 0; i < chunks.size() && ! result; i++)
+    {
+        if (chunks[i].error.empty()) continue;
+
+        J line = 1;
+        for (const char* p = base; p < chunks[i].error_at; p++) line += *p == '\n';
+        result = located_error(chunks[i].error, "line", line);
+    }
+
+    if (! result)
+    {
+        J rows = 0;
+        for (size_t i = 0; i < chunks.size(); i++) rows += chunks[i].rows;
+
+        K names = ktn(KS, specs.size());
+        K values = ktn(0, specs.size());
+        for (size_t c = 0; c < specs.size(); c++)
+        {
+            kS(names)[c] = ss((S)specs[c].name.c_str());
+            kK(values)[c] = merge_column(chunks, c, specs[c].type, rows);
+        }
+        result = xT(xD(names, values));
+    }
+
+    return result;
+}
+
+/*
+    Appending
+
+    fromjsoninto[`t; text] parses rows as fromjson does, with the schema
+    taken from the columns of the table t, and appends them to t in place
+    rather than through a temporary table. The rows are staged first, so
+    text with an error leaves t as it was.
+*/
+
+// Appends the staged values of a column onto a q vector
+static void append_column(K& x, const BufferColumn& col)
+{
+    if (col.type == 0)
+    {
+        for (J r = 0; r < col.n; r++)
+        {
+            jk(&x, kpn((S)col.strings[r].data(), col.strings[r].size()));
+        }
+    }
+    else if (col.type == KS)
+    {
+        std::vector<S> syms(col.strings.size());
+        for (size_t i = 0; i < syms.size(); i++)
+        {
+            syms[i] = ss((S)col.strings[i].c_str());
+        }
+        const I* codes = (const I*)col.data.data();
+        for (J r = 0; r < col.n; r++)
+        {
+            js(&x, syms[codes[r]]);
+        }
+    }
+    else
+    {
+        const int width = type_width(col.type);
+        for (J r = 0; r < col.n; r++)
+        {
+            ja(&x, (V*)(col.data.data() + r * width));
+        }
+    }
+}
+
+extern "C" K fromjsoninto(K name, K text)
+{
+    if (name->t != -KS || text->t != KC) return krr((S)"type");
+
+    const K t = k(0, (S)"value", r1(name), (K)0);
+    if (! t || t->t == -128) return t;
+    if (t->t != XT)
     {
-        serialise_keyed_table(w, keys, values);
+        r0(t);
+        return krr((S)"type");
     }
-    else
+
+    // The schema, from the types of the columns (not enumerations or nested types)
+    const K names = kK(t->k)[0];
+    const K values = kK(t->k)[1];
+    std::vector<ColumnSpec> specs;
+    for (J j = 0; j < names->n; j++)
     {
-        w.StartObject();
-        for (int i = 0; i < keys->n; i++)
+        ColumnSpec c;
+        c.name = kS(names)[j];
+        c.type = kK(values)[j]->t;
+        if (c.type < 0 || c.type > KT || c.type == 3)
         {
-            serialise_atom(w, keys, i);
-            serialise_atom(w, values, i);
+            r0(t);
+            return krr((S)"type");
         }
-        w.EndObject();
+        specs.push_back(c);
+    }
+
+    std::vector<BufferColumn> cols(specs.begin(), specs.end());
+    SchemaHandler<BufferColumn> handler(cols);
+    Reader reader;
+    MemoryStream ms((const char*)kC(text), text->n);
+    ParseResult ok = reader.Parse<kParseIterativeFlag>(ms, handler);
+
+    if (! ok)
+    {
+        r0(t);
+        if (handler.error.empty()) return krr((S)GetParseError_En(ok.Code()));
+        return located_error(handler.error, "row", handler.rows);
+    }
+    const J rows = handler.rows;
+
+    // Only t itself (and this reference to it) may hold the columns to grow
+    // them in place. Shared columns, ones with an attribute appending could
+    // break, and mapped ones (whose memory q does not own) go through q's
+    // insert instead.
+    bool in_place = t->r == 1 && t->k->r == 0 && values->r == 0;
+    for (J j = 0; j < values->n && in_place; j++)
+    {
+        in_place = kK(values)[j]->r == 0 && kK(values)[j]->u == 0 && kK(values)[j]->m == 0;
+    }
+
+    if (in_place)
+    {
+        for (size_t j = 0; j < cols.size(); j++)
+        {
+            append_column(kK(values)[j], cols[j]);
+        }
+        r0(t);
+        return kj(rows);
+    }
+
+    K added = ktn(0, cols.size());
+    for (size_t j = 0; j < cols.size(); j++)
+    {
+        kK(added)[j] = ktn(cols[j].type, 0);
+        append_column(kK(added)[j], cols[j]);
     }
+    const K rows_added = xT(xD(r1(names), added));
+    r0(t);
+
+    const K r = k(0, (S)"insert", r1(name), rows_added, (K)0);
+    if (! r || r->t == -128) return r;
+    r0(r);
+    return kj(rows);
 }
 
-template<typename Writer>
-void serialise_keyed_table(Writer& w, K keys, K values)
+/*
+    Path extraction
+
+    jsonget[paths; text] pulls the values at one or more dotted paths (eg:
+    `data.price, with numeric components indexing arrays) out of a document
+    without building the rest of it. Subtrees which are not on a requested
+    path are skipped, and parsing stops as soon as every path has been found.
+    Objects and arrays found at a path are returned as their JSON text.
+    Documents nested deeper than max_path_depth fail to parse.
+*/
+
+// Deepest nesting jsonget reads into. The Reader recurses once per level, so
+// without a limit a hostile document could overflow the stack.
+static const size_t max_path_depth = 1024;
+
+class PathHandler : public BaseReaderHandler<UTF8<>, PathHandler>
 {
-    const K kdict = keys->k;
-    const K kkeys = kK(kdict)[0];
-    const K kvalues = kK(kdict)[1];
+public:
+    PathHandler(const std::vector<std::vector<std::string> >& paths, const char* text, MemoryStream& ms, std::vector<K>& out)
+        : paths(paths), text(text), ms(ms), out(out), seen(paths.size()), found(0), skip(0)
+    {
+        for (size_t p = 0; p < paths.size(); p++) current.push_back(p);
+    }
 
-    const K vdict = values->k;
-    const K vkeys = kK(vdict)[0];
-    const K vvalues = kK(vdict)[1];
+    // Scalars are only made into q objects once a path has matched them
+    bool Null()                 { return ! wanted() || capture(0); }
+    bool Bool(bool b)           { return ! wanted() || capture(kb(b)); }
+    bool Int(int i)             { return ! wanted() || capture(kj(i)); }
+    bool Uint(unsigned u)       { return ! wanted() || capture(kj(u)); }
+    bool Int64(int64_t i)       { return ! wanted() || capture(kj(i)); }
+    bool Uint64(uint64_t u)     { return ! wanted() || capture(u > (uint64_t)wj ? kf(u) : kj(u)); }
+    bool Double(double d)       { return ! wanted() || capture(kf(d)); }
 
-    const int krows = kK(kvalues)[0]->n;
-    const int vrows = kK(vvalues)[0]->n;
+    bool String(const char* str, SizeType len, bool)
+    {
+        return ! wanted() || capture(kpn((S)str, len));
+    }
 
-    assert(vrows == krows);
+    bool Key(const char* str, SizeType len, bool)
+    {
+        if (skip) return true;
+        match(std::string(str, len));
+        return true;
+    }
 
-    #ifndef NDEBUG
-    std::cerr << "Keyed Table" << std::endl;
-    std::cerr << "Key count:  " << kkeys->n << std::endl;
-    std::cerr << "Key length: " << kvalues->n << std::endl;
-    std::cerr << "Key rows:   " << krows << std::endl;
+    bool StartObject()          { return start(false); }
+    bool StartArray()           { return start(true); }
+    bool EndObject(SizeType)    { return end(); }
+    bool EndArray(SizeType)     { return end(); }
 
-    std::cerr << "V column count: " << vkeys->n << std::endl;
-    std::cerr << "V length:       " << vvalues->n << std::endl;
-    std::cerr << "V rows:         " << vrows << std::endl;
-    #endif
+    bool done() const { return found == paths.size(); }
 
-    // In kdb+, .j.j will serialise a keyed table as a dictionary of key objects to value objects.
-    // However, this is not valid JSON. Instead, we serialise it as if it was an unkeyed table.
-    w.StartArray();
-    for (int i = 0; i < krows; i++)
+private:
+    struct Level
     {
-        w.StartObject();
-        for (int j = 0; j < kkeys->n; j++)
+        std::vector<int> cands;     // paths continuing below this container
+        std::vector<int> captures;  // paths ending at this container
+        size_t start;
+        J index;                    // next element, for arrays
+        bool array;
+    };
+
+    // Narrows the candidates of the enclosing container down to the paths
+    // whose next component is the given key or array index.
+    void match(const std::string& key)
+    {
+        const Level& l = levels.back();
+        const size_t depth = levels.size() - 1;
+        current.clear();
+        for (size_t c = 0; c < l.cands.size(); c++)
         {
-            serialise_atom(w, kkeys, j);
-            serialise_atom(w, kK(kvalues)[j], i);
+            const int p = l.cands[c];
+            if (paths[p][depth] == key) current.push_back(p);
         }
-        for (int j = 0; j < vkeys->n; j++)
+    }
+
+    void element()
+    {
+        if (! levels.empty() && levels.back().array)
         {
-            serialise_atom(w, vkeys, j);
-            serialise_atom(w, kK(vvalues)[j], i);
+            char buff[24];
+            snprintf(buff, sizeof(buff), "%lld", levels.back().index++);
+            match(buff);
         }
-        w.EndObject();
     }
-    w.EndArray();
-}
 
-template<typename Writer>
-void serialise_table(Writer& w, K x, bool isvec, int i)
-{
-    const K dict = x->k;
-    const K keys = kK(dict)[0];
-    const K values = kK(dict)[1];
+    // Whether the scalar being read ends a path not yet found, stepping
+    // past it in an enclosing array either way
+    bool wanted()
+    {
+        if (skip) return false;
+        element();
 
-    if (i >= 0)
+        const size_t depth = levels.size();
+        for (size_t c = 0; c < current.size(); c++)
+        {
+            const int p = current[c];
+            if (paths[p].size() == depth && ! seen[p]) return true;
+        }
+        return false;
+    }
+
+    // Stores the scalar x (0 for null) at every path wanted found ending here
+    bool capture(K x)
     {
-        w.StartObject();
-        for (int j = 0; j < keys->n; j++)
+        const size_t depth = levels.size();
+        bool stored = false;
+        for (size_t c = 0; c < current.size(); c++)
         {
-            serialise_atom(w, keys, j);
-            serialise_atom(w, kK(values)[j], i);
+            const int p = current[c];
+            if (paths[p].size() == depth && ! seen[p])
+            {
+                out[p] = x && stored ? r1(x) : x;
+                stored = true;
+                seen[p] = true;
+                found++;
+            }
         }
-        w.EndObject();
+        return ! done();
     }
-    else
+
+    bool start(bool array)
     {
-        const int rows = kK(values)[0]->n;
+        if (levels.size() + skip >= max_path_depth) return false;
+        if (skip)
+        {
+            skip++;
+            return true;
+        }
+        element();
 
-        w.StartArray();
-        for (int i = 0; i < rows; i++)
+        Level l;
+        l.start = ms.Tell() - 1;
+        l.index = 0;
+        l.array = array;
+
+        const size_t depth = levels.size();
+        for (size_t c = 0; c < current.size(); c++)
         {
-            w.StartObject();
-            for (int j = 0; j < keys->n; j++)
+            const int p = current[c];
+            if (paths[p].size() == depth) l.captures.push_back(p);
+            else l.cands.push_back(p);
+        }
+
+        if (l.cands.empty() && l.captures.empty())
+        {
+            skip = 1;
+            return true;
+        }
+        levels.push_back(l);
+        current.clear();
+        return true;
+    }
+
+    bool end()
+    {
+        if (skip)
+        {
+            skip--;
+            return true;
+        }
+
+        const Level& l = levels.back();
+        for (size_t c = 0; c < l.captures.size(); c++)
+        {
+            const int p = l.captures[c];
+            if (! seen[p])
             {
-                serialise_atom(w, keys, j);
-                serialise_atom(w, kK(values)[j], i);
+                out[p] = kpn((S)text + l.start, ms.Tell() - l.start);
+                seen[p] = true;
+                found++;
             }
-            w.EndObject();
         }
-        w.EndArray();
+        levels.pop_back();
+        return ! done();
+    }
+
+    const std::vector<std::vector<std::string> >& paths;
+    const char* text;
+    MemoryStream& ms;
+    std::vector<K>& out;
+    std::vector<bool> seen;
+    std::vector<Level> levels;
+    std::vector<int> current;
+    size_t found;
+    int skip;
+};
+
+// Runs the path handler over one document, leaving 0 in out for paths that
+// were not found.
+static bool extract_paths(const std::vector<std::vector<std::string> >& paths, K text, std::vector<K>& out)
+{
+    out.assign(paths.size(), (K)0);
+
+    MemoryStream ms((const char*)kC(text), text->n);
+    PathHandler handler(paths, (const char*)kC(text), ms, out);
+    Reader reader;
+    ParseResult ok = reader.Parse(ms, handler);
+
+    if (! ok && ! handler.done())
+    {
+        for (size_t p = 0; p < out.size(); p++)
+        {
+            if (out[p]) r0(out[p]);
+            out[p] = 0;
+        }
+        return false;
     }
+    return true;
 }
 
-template<typename Writer>
-void serialise_atom(Writer& w, const K x, int i)
+// Turns the values found at one path across many documents into a simple
+// vector where they agree on a type, filling in nulls for missing values.
+static K collapse(const std::vector<K>& values)
 {
-    bool isvec = x->t >= 0;
+    int t = 0;
+    bool mixed = false, missing = false;
+    for (size_t i = 0; i < values.size(); i++)
+    {
+        const K v = values[i];
+        if (! v)
+        {
+            missing = true;
+        }
+        else if (t == 0)
+        {
+            t = v->t;
+        }
+        else if (t != v->t)
+        {
+            // Integral and fractional numbers are both just numbers in JSON
+            if ((t == -KJ || t == -KF) && (v->t == -KJ || v->t == -KF)) t = -KF;
+            else mixed = true;
+        }
+    }
 
-    switch (x->t)
+    if (! mixed && (t == -KJ || t == -KF || (t == -KB && ! missing)))
     {
-        case (0):
-            serialise_list(w, x, isvec, i); break;
+        K x = ktn(-t, values.size());
+        for (size_t i = 0; i < values.size(); i++)
+        {
+            const K v = values[i];
+            if (t == -KB)       kG(x)[i] = v->g;
+            else if (t == -KJ)  kJ(x)[i] = v ? v->j : nj;
+            else                kF(x)[i] = ! v ? nf : v->t == -KJ ? (F)v->j : v->f;
+            if (v) r0(v);
+        }
+        return x;
+    }
 
-        case (KS):
-        case (-KS):
-            serialise_sym(w, x, isvec, i); break;
+    K x = ktn(0, values.size());
+    for (size_t i = 0; i < values.size(); i++)
+    {
+        kK(x)[i] = values[i] ? values[i] : identity();
+    }
+    return x;
+}
 
-        case (KC):
-        case (-KC):
-            serialise_char(w, x, isvec, i); break;
+extern "C" K jsonget(K paths, K text)
+{
+    if (paths->t != KS && paths->t != -KS) return krr((S)"type");
 
-        case (KB):
-        case (-KB):
-            serialise_bool(w, x, isvec, i); break;
+    std::vector<std::vector<std::string> > parsed;
+    const J npaths = paths->t == KS ? paths->n : 1;
+    for (J p = 0; p < npaths; p++)
+    {
+        const char* s = paths->t == KS ? kS(paths)[p] : paths->s;
+        std::vector<std::string> path;
+        for (const char* dot; (dot = strchr(s, '.')); s = dot + 1)
+        {
+            path.push_back(std::string(s, dot - s));
+        }
+        path.push_back(s);
+        parsed.push_back(path);
+    }
 
-        case (KG):
-        case (-KG):
-            serialise_byte(w, x, isvec, i); break;
+    std::vector<K> out;
 
-        case (KH):
-        case (-KH):
-            serialise_short(w, x, isvec, i); break;
+    if (text->t == KC)
+    {
+        if (! extract_paths(parsed, text, out)) return krr((S)"json");
 
-        case (KI):
-        case (-KI):
-            serialise_int(w, x, isvec, i); break;
+        if (paths->t == -KS) return out[0] ? out[0] : identity();
 
-        case (KJ):
-        case (-KJ):
-            serialise_long(w, x, isvec, i); break;
+        K x = ktn(0, npaths);
+        for (J p = 0; p < npaths; p++)
+        {
+            kK(x)[p] = out[p] ? out[p] : identity();
+        }
+        return x;
+    }
 
-        case (KE):
-        case (-KE):
-            serialise_float(w, x, isvec, i); break;
+    if (text->t != 0) return krr((S)"type");
 
-        case (KF):
-        case (-KF):
-            serialise_double(w, x, isvec, i); break;
+    // Vectorised over a list of documents: one list of values per path.
+    // Documents which fail to parse give nulls.
+    std::vector<std::vector<K> > columns(npaths, std::vector<K>(text->n));
+    for (J i = 0; i < text->n; i++)
+    {
+        const K doc = kK(text)[i];
+        if (doc->t == KC) extract_paths(parsed, doc, out);
+        else out.assign(npaths, (K)0);
 
-        case (XT):
-            serialise_table(w, x, isvec, i); break;
+        for (J p = 0; p < npaths; p++)
+        {
+            columns[p][i] = out[p];
+        }
+    }
 
-        case (XD):
-            serialise_dict(w, x, isvec, i); break;
+    if (paths->t == -KS) return collapse(columns[0]);
 
-        case (KD):
-        case (-KD):
-            serialise_date(w, x, isvec, i); break;
+    K x = ktn(0, npaths);
+    for (J p = 0; p < npaths; p++)
+    {
+        kK(x)[p] = collapse(columns[p]);
+    }
+    return x;
+}
 
-        case (KT):
-        case (-KT):
-            serialise_time(w, x, isvec, i); break;
+/*
+    Validation
 
-        case (KP):
-        case (-KP):
-            serialise_timestamp(w, x, isvec, i); break;
+    validjson[text] checks a string, or each of a list of strings, without
+    building anything. Encoding is checked up front, sixteen bytes at a time
+    while the text is plain ASCII, leaving the Reader to check the structure
+    with a handler that ignores every value. The Reader parses iteratively,
+    so no depth of nesting can overflow the stack.
+*/
 
-        case (KZ):
-        case (-KZ):
-            serialise_datetime(w, x, isvec, i); break;
+// Well-formed UTF-8 without embedded nulls (which the Reader would take as
+// the end of the document).
+static bool valid_utf8(const unsigned char* s, size_t n)
+{
+    size_t i = 0;
+    while (i < n)
+    {
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        while (i + 16 <= n)
+        {
+            const __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+            if (_mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, zero))) != 0) break;
+            i += 16;
+        }
+        if (i == n) break;
+#endif
+        const unsigned char c = s[i];
+        int len;
+        unsigned cp;
 
-        case (UU):
-        case (-UU):
-            serialise_guid(w, x, isvec, i); break;
+        if (c == 0)                 return false;
+        else if (c < 0x80)          { i++; continue; }
+        else if ((c & 0xE0) == 0xC0) { len = 2; cp = c & 0x1F; }
+        else if ((c & 0xF0) == 0xE0) { len = 3; cp = c & 0x0F; }
+        else if ((c & 0xF8) == 0xF0) { len = 4; cp = c & 0x07; }
+        else                        return false;
 
-        case (KM):
-        case (-KM):
-            serialise_month(w, x, isvec, i); break;
+        if (i + len > n) return false;
+        for (int k = 1; k < len; k++)
+        {
+            if ((s[i + k] & 0xC0) != 0x80) return false;
+            cp = (cp << 6) | (s[i + k] & 0x3F);
+        }
 
-        case (KN):
-        case (-KN):
-            serialise_timespan(w, x, isvec, i); break;
+        // Overlong forms, surrogates and anything past U+10FFFF
+        static const unsigned min_cp[5] = { 0, 0, 0x80, 0x800, 0x10000 };
+        if (cp < min_cp[len] || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) return false;
+        i += len;
+    }
+    return true;
+}
 
-        case (KU):
-        case (-KU):
-            serialise_minute(w, x, isvec, i); break;
+static bool valid_json(K x)
+{
+    if (x->t != KC || ! valid_utf8(kG(x), x->n)) return false;
 
-        case (KV):
-        case (-KV):
-            serialise_second(w, x, isvec, i); break;
+    BaseReaderHandler<> handler;
+    Reader reader;
+    MemoryStream ms((const char*)kC(x), x->n);
+    return ! reader.Parse<kParseIterativeFlag | kParseNumbersAsStringsFlag>(ms, handler).IsError();
+}
 
-        // MAGIC: Enumerated symbols (eg: splayed tables)
-        case (20):
-        case (-20):
-            serialise_enum_sym(w, x, isvec, i); break;
+extern "C" K validjson(K x)
+{
+    if (x->t == KC) return kb(valid_json(x));
+    if (x->t != 0) return krr((S)"type");
 
-        default:
-            #ifndef NDEBUG
-            std::cerr << "WARNING: unhandled atom (" << (int)x->t << ")" << std::endl;
-            #endif
-            w.Null();
-            break;
+    K r = ktn(KB, x->n);
+    for (J i = 0; i < x->n; i++)
+    {
+        kG(r)[i] = valid_json(kK(x)[i]);
     }
+    return r;
 }
 
-extern "C" K tojson(K x)
+/*
+    Splayed tables on disk
+
+    tojsonsplay[dirs; cols; rows] serialises a splayed table straight from
+    its column files, as tojson would once it was loaded, without reading it
+    into q. dirs is the directory of the table, or a list of them (eg: the
+    table in several partitions) whose rows follow on from one another. cols
+    lists the columns, or :: for all of them (as listed in .d), and rows is
+    :: or a pair of the first row and the number of rows to write. The
+    columns are mapped a directory at a time, and symbols enumerated against
+    sym are looked up in the database's sym file, found once above the first
+    directory. Nested and compressed columns are not supported.
+*/
+
+// The symbols of a mapped symbol list file (eg: sym or .d)
+static bool read_sym_file(const MappedFile& f, std::vector<const char*>& syms)
+{
+    const unsigned char* h = (const unsigned char*)f.data;
+    J n;
+    const char* p;
+    if (f.size >= 16 && h[0] == 0xfe && h[1] == 0x20 && h[2] == KS)
+    {
+        memcpy(&n, f.data + 8, sizeof(J));
+        p = f.data + 16;
+    }
+    else if (f.size >= 8 && h[0] == 0xff && h[1] == 0x01 && h[2] == KS)
+    {
+        I n32;
+        memcpy(&n32, f.data + 4, sizeof(I));
+        n = n32;
+        p = f.data + 8;
+    }
+    else
+    {
+        return false;
+    }
+
+    const char* end = f.data + f.size;
+    syms.reserve(n);
+    for (J i = 0; i < n; i++)
+    {
+        const char* z = (const char*)memchr(p, 0, end - p);
+        if (! z) return false;
+        syms.push_back(p);
+        p = z + 1;
+    }
+    return true;
+}
+
+// A mapped column file of a splayed table
+struct SplayColumn
+{
+    SplayColumn() : vector(0), enums(0), width(0), rows(0) {}
+
+    MappedFile file;
+    K vector;               // a simple vector, laid out on disk as q has it in memory
+    const char* enums;      // or the indices of an enumeration against sym
+    int width;              // bytes per index
+    J rows;
+};
+
+// An enumerated column file has the 16 byte header of its vector, with the
+// count of indices. When q records the domain, its name follows, and the
+// header is padded out to a block of this many bytes. The indices come
+// next, and any attribute data (eg: of p#) after them.
+static const size_t enum_header_block = 4096;
+
+// Whether the bytes after the vector header are a domain name padded with
+// zeros to the end of the header block, rather than the indices themselves
+static bool names_enum_domain(const MappedFile& f)
+{
+    if (f.size < enum_header_block || ! isalpha((unsigned char)f.data[16])) return false;
+    const char* end = (const char*)memchr(f.data + 16, 0, enum_header_block - 16);
+    if (! end) return false;
+    for (const char* p = end; p < f.data + enum_header_block; p++)
+    {
+        if (*p) return false;
+    }
+    return true;
+}
+
+// Finds the vector in a mapped column file
+static bool read_splay_column(SplayColumn& c)
+{
+    const MappedFile& f = c.file;
+    const unsigned char* h = (const unsigned char*)f.data;
+    if (f.size < 16 || h[0] != 0xfe || h[1] != 0x20) return false;
+
+    const int t = (signed char)h[2];
+    memcpy(&c.rows, f.data + 8, sizeof(J));
+    if (c.rows < 0) return false;
+
+    if (t == 20)
+    {
+        size_t at = 16;
+        if (names_enum_domain(f))
+        {
+            // The domain, which must be sym as that is what is looked up
+            if (strcmp(f.data + at, "sym") != 0) return false;
+            at = enum_header_block;
+        }
+
+        // 32-bit indices, as serialise_enum_sym reads them in memory, unless
+        // a file without attribute data holds exactly enough for 64-bit ones
+        const size_t data = f.size - at;
+        c.width = h[3] == 0 && (J)(data / 8) == c.rows && data % 8 == 0 ? 8 : 4;
+        if ((J)(data / c.width) < c.rows) return false;
+        if (h[3] == 0 && data != (size_t)c.rows * c.width) return false;
+        c.enums = f.data + at;
+        return true;
+    }
+
+    if (t < KB || t > KV || t == 3 || t == KS) return false;
+    if ((J)((f.size - 16) / type_width(t)) < c.rows) return false;
+
+    // Used as a K as it is, which relies on the 16 bytes of the file's
+    // header (m, a, t, u, r and n) being laid out as q's K0 is in memory
+    c.vector = (K)f.data;
+    return true;
+}
+
+// The directory above a path
+static std::string parent_dir(std::string path)
+{
+    while (path.size() > 1 && path[path.size() - 1] == '/') path.erase(path.size() - 1);
+    const size_t slash = path.rfind('/');
+    return slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+}
+
+extern "C" K tojsonsplay(K dirs, K cols, K rows)
 {
+    std::vector<std::string> tables;
+    if (dirs->t == KS)
+    {
+        for (J i = 0; i < dirs->n; i++)
+        {
+            const S d = kS(dirs)[i];
+            tables.push_back(d[0] == ':' ? d + 1 : d);
+        }
+    }
+    else
+    {
+        std::string d;
+        if (! file_path(dirs, d)) return krr((S)"type");
+        tables.push_back(d);
+    }
+
+    J first = 0;
+    J last = 0x7fffffffffffffffLL;
+    if (rows->t != 101)
+    {
+        if ((rows->t != KJ && rows->t != KI) || rows->n != 2) return krr((S)"type");
+        first = rows->t == KJ ? kJ(rows)[0] : kI(rows)[0];
+        const J count = rows->t == KJ ? kJ(rows)[1] : kI(rows)[1];
+        if (first < 0 || count < 0) return krr((S)"domain");
+        last = first + count;
+    }
+
+    // The columns, as given or as listed in .d
+    std::vector<std::string> names;
+    if (cols->t == KS)
+    {
+        for (J j = 0; j < cols->n; j++) names.push_back(kS(cols)[j]);
+    }
+    else if (cols->t == -KS)
+    {
+        names.push_back(cols->s);
+    }
+    else if (cols->t == 101)
+    {
+        if (tables.empty()) return krr((S)"length");
+        const std::string file = tables[0] + "/.d";
+        MappedFile d;
+        std::vector<const char*> syms;
+        if (! d.open(file)) return orr(ss((S)file.c_str()));
+        if (! read_sym_file(d, syms)) return krr(ss((S)file.c_str()));
+        names.assign(syms.begin(), syms.end());
+    }
+    else
+    {
+        return krr((S)"type");
+    }
+
+    // The sym file, found above the first directory when it is needed
+    MappedFile symfile;
+    std::vector<const char*> syms;
+
+    typedef JsonWriter<StringBuffer> SplayWriter;
     StringBuffer buffer;
-    Writer<StringBuffer> writer(buffer);
+    SplayWriter writer(buffer);
+    std::vector<Serialiser<SplayWriter> > serialisers(names.size());
 
-    serialise_atom(writer, x);
+    writer.StartArray();
+    J at = 0;
+    for (size_t p = 0; p < tables.size() && at < last; p++)
+    {
+        std::vector<SplayColumn> columns(names.size());
+        J n = 0;
+        for (size_t j = 0; j < names.size(); j++)
+        {
+            SplayColumn& c = columns[j];
+            const std::string file = tables[p] + "/" + names[j];
+            if (! c.file.open(file)) return orr(ss((S)file.c_str()));
+            if (! read_splay_column(c)) return krr(ss((S)file.c_str()));
+            if (j > 0 && c.rows != n) return krr((S)"length");
+            n = c.rows;
 
-    size_t len = buffer.GetLength();
-    const char* str = buffer.GetString();
+            if (c.vector) serialisers[j] = serialiser_of<SplayWriter>(c.vector->t);
+            if (c.enums && ! symfile.data)
+            {
+                const std::string dir = parent_dir(tables[0]);
+                if (! symfile.open(dir + "/sym") && ! symfile.open(parent_dir(dir) + "/sym")) return krr((S)"sym");
+                if (! read_sym_file(symfile, syms)) return krr((S)"sym");
+            }
+        }
 
-    // Marshal to kdb
-    K ser = kpn((char*)str, len);
+        const J lo = std::max(first - at, (J)0);
+        const J hi = std::min(last - at, n);
+        for (J i = lo; i < hi && writer.Check(); i++)
+        {
+            writer.StartObject();
+            for (size_t j = 0; j < names.size(); j++)
+            {
+                const SplayColumn& c = columns[j];
+                writer.String(names[j].c_str(), names[j].size());
+                if (c.vector)
+                {
+                    serialisers[j](writer, c.vector, true, i);
+                    continue;
+                }
 
-    return ser;
+                J e;
+                if (c.width == 8) memcpy(&e, c.enums + 8 * i, 8);
+                else
+                {
+                    I e32;
+                    memcpy(&e32, c.enums + 4 * i, 4);
+                    e = e32 == ni ? nj : e32;
+                }
+                if (e >= 0 && e < (J)syms.size()) writer.String(syms[e]);
+                else writer.Null();
+            }
+            writer.EndObject();
+        }
+        at += n;
+    }
+    writer.EndArray();
+
+    return kpn((char*)buffer.GetString(), buffer.GetLength());
 }